@@ -0,0 +1,64 @@
+/* VM dispatch benchmark
+ *
+ * Times call heavy and arithmetic heavy programs on the bytecode VM. The bench_dispatch target builds it twice, with
+ * the portable switch dispatch loop and with direct threading (LISP_COMPUTED_GOTO), and runs both.
+ */
+#include <chrono>
+#include <iostream>
+
+#include "lisp.h"
+
+struct program {
+    const char *name;
+    std::vector<std::string> setup;
+    std::string run;
+};
+
+const program programs[] = {
+    { "fib 25 (calls)",
+      { "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))" },
+      "(fib 25)" },
+    { "tak 22 16 8 (calls)",
+      { "(define tak (lambda (x y z) (if (not (< y x)) z "
+        "(tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)))))" },
+      "(tak 22 16 8)" },
+    { "sum loop 2M (arithmetic)",
+      { "(define sum (lambda (n acc) (if (< n 1) acc (sum (- n 1) (+ acc (- (+ n n) n))))))" },
+      "(sum 2000000 0)" },
+    { "count-down 2M (arithmetic)",
+      { "(define cd (lambda (n a b) (if (< n 1) (+ a b) (cd (- n 1) (+ a 1) (- b 1)))))" },
+      "(cd 2000000 0 0)" },
+};
+
+int main()
+{
+    const int rounds = 5;
+
+    lisp::use_vm = true;
+    lisp::environment global_env;     lisp::add_globals(global_env);
+
+#if defined(LISP_COMPUTED_GOTO) && defined(__GNUC__)
+    std::cout << "dispatch: direct threaded" << std::endl;
+#else
+    std::cout << "dispatch: switch" << std::endl;
+#endif
+    for (auto &p: programs)
+    {
+        for (auto &form: p.setup)
+            lisp::eval_string(form, &global_env);
+
+        // best of 'rounds'
+        double best = 0;
+        std::string result;
+        for (int i = 0; i < rounds; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            lisp::lisp_cell val = lisp::eval_string(p.run, &global_env);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            if (i == 0 || elapsed.count() < best)
+                best = elapsed.count();
+            result = lisp::printLispObject(val);
+        }
+        std::cout << "  " << p.name << ": " << best << " ms (" << result << ")" << std::endl;
+    }
+}
@@ -0,0 +1,259 @@
+/* Microbenchmarks of the layers of lisp.h
+ *
+ * Each benchmark isolates one layer: making lisp_cells, the getValue<T> type tests, environment::FindSymbol and the
+ * cached environment::FindGlobal through chains of environments of increasing depth, FindSymbol in environments of
+ * increasing size, eval_proc dispatch to a primitive, the reader and the printer over
+ * generated text. Every benchmark prints one JSON object per line, with the best of 'rounds' runs:
+ *
+ *  {"bench": "find_symbol/depth 16", "ns_per_op": 155.0}
+ *  {"bench": "read/data", "mb_per_s": 27.5}
+ *
+ * usage: bench_micro
+ */
+#include <chrono>
+#include <iostream>
+
+#include "lisp.h"
+
+using namespace lisp;
+
+const int rounds = 5;
+
+// results are summed into 'sink' so that the compiler cannot drop the work
+static volatile uint64_t sink;
+
+// the best time of 'rounds' calls of 'f', in ns
+template <typename F>
+static double best_of(F f)
+{
+    double best = 0;
+    for (int i = 0; i < rounds; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        if (i == 0 || elapsed.count() < best)
+            best = elapsed.count();
+    }
+    return best;
+}
+
+template <typename F>
+static void time_ops(const std::string &name, size_t n, F f)
+{
+    std::cout << "{\"bench\": \"" << name << "\", \"ns_per_op\": " << best_of(f) / n << "}" << std::endl;
+}
+
+template <typename F>
+static void time_bytes(const std::string &name, size_t bytes, F f)
+{
+    std::cout << "{\"bench\": \"" << name << "\", \"mb_per_s\": " << bytes / best_of(f) * 1e3 << "}" << std::endl;
+}
+
+static void cells(void)
+{
+    const size_t n = 10000000;
+    symbol *sym = intern("bench-symbol");
+
+    time_ops("cell/integer", n, [] {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += lisp_cell(static_cast<lisp_int_t>(i)).bits();
+        sink = sink + sum;
+    });
+    time_ops("cell/double", n, [] {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += lisp_cell(static_cast<double>(i) * 0.5).bits();
+        sink = sink + sum;
+    });
+    std::vector<symbol *> symbols;
+    for (int i = 0; i < 16; i++)
+        symbols.push_back(intern("bench-symbol-" + std::to_string(i)));
+    time_ops("cell/symbol", n, [&symbols] {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += lisp_cell(symbols[i & 15]).bits();
+        sink = sink + sum;
+    });
+
+    // a mix of types, so that about every other test fails
+    std::vector<lisp_cell> mix;
+    for (size_t i = 0; i < 1024; i++)
+        mix.push_back(i % 3 == 0 ? lisp_cell(static_cast<lisp_int_t>(i)) :
+                      i % 3 == 1 ? lisp_cell(i * 0.25) : lisp_cell(sym));
+    time_ops("get_value/integer", n, [&mix] {
+        uint64_t sum = 0;
+        lisp_int_t v;
+        for (size_t i = 0; i < n; i++)
+            if (mix[i & 1023].getValue<lisp_int_t>(v))
+                sum += v;
+        sink = sink + sum;
+    });
+    time_ops("get_value/double", n, [&mix] {
+        double sum = 0, v;
+        for (size_t i = 0; i < n; i++)
+            if (mix[i & 1023].getValue<double>(v))
+                sum += v;
+        sink = sink + static_cast<uint64_t>(sum);
+    });
+    time_ops("get_value/symbol", n, [&mix] {
+        uint64_t sum = 0;
+        symbol *v;
+        for (size_t i = 0; i < n; i++)
+            if (mix[i & 1023].getValue<symbol *>(v))
+                sum += v->id();
+        sink = sink + sum;
+    });
+}
+
+static void find_symbol(environment *global_env)
+{
+    const size_t n = 1000000;
+    symbol *sym = intern("bench-global");
+    (*global_env)["bench-global"] = lisp_cell(static_cast<lisp_int_t>(1));
+    global_ref *ref = new global_ref(sym);
+    gc_root ref_root(ref);
+
+    for (int depth: { 1, 4, 16, 64 })
+    {
+        // 'depth' environments of 8 variables each on top of the global one
+        environment *env = global_env;
+        gc_root root(env);
+        for (int d = 0; d < depth; d++)
+        {
+            env = new environment(env);
+            for (int v = 0; v < 8; v++)
+                (*env)["bench-local-" + std::to_string(v)] = lisp_cell(static_cast<lisp_int_t>(v));
+        }
+
+        time_ops("find_symbol/depth " + std::to_string(depth), n, [env, sym] {
+            uint64_t sum = 0;
+            lisp_cell val;
+            for (size_t i = 0; i < n; i++)
+                if (env->FindSymbol(sym, val))
+                    sum += val.bits();
+            sink = sink + sum;
+        });
+        time_ops("find_global/depth " + std::to_string(depth), n, [env, ref] {
+            uint64_t sum = 0;
+            lisp_cell val;
+            for (size_t i = 0; i < n; i++)
+                if (env->FindGlobal(ref, val))
+                    sum += val.bits();
+            sink = sink + sum;
+        });
+    }
+}
+
+static void find_symbol_size(void)
+{
+    const size_t n = 1000000;
+    for (int size: { 10, 1000, 100000 })
+    {
+        // 'size' variables, looked up in turn. The environment is on the heap: the write barrier of operator[]
+        // remembers it, so it must outlive the next collection
+        environment *env = new environment();
+        gc_root root(env);
+        std::vector<symbol *> symbols;
+        for (int v = 0; v < size; v++)
+        {
+            std::string name = "bench-size-" + std::to_string(v);
+            (*env)[name] = lisp_cell(static_cast<lisp_int_t>(v));
+            symbols.push_back(intern(name));
+        }
+
+        time_ops("find_symbol/size " + std::to_string(size), n, [env, &symbols] {
+            uint64_t sum = 0;
+            lisp_cell val;
+            for (size_t i = 0, v = 0; i < n; i++, v = v + 1 == symbols.size() ? 0 : v + 1)
+                if (env->FindSymbol(symbols[v], val))
+                    sum += val.bits();
+            sink = sink + sum;
+        });
+    }
+}
+
+static void dispatch(environment *global_env)
+{
+    const size_t n = 1000000;
+    lisp_cell proc, args;
+    gc_root root(proc, args);
+    global_env->FindSymbol(intern("+"), proc);
+    reader r("(1 2)");
+    r.read(args);
+
+    time_ops("eval_proc/+", n, [&] {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += eval_proc(proc, args, global_env).bits();
+        sink = sink + sum;
+    });
+}
+
+// generated text to read, of about 'size' bytes
+static std::string corpus(const std::string &kind, size_t size)
+{
+    std::string s;
+    for (int i = 0; s.size() < size; i++)
+    {
+        std::string n = std::to_string(i);
+        if (kind == "code")
+            s += "(define f" + n + " (lambda (a b) (if (< a " + n + ") (+ a b) (f" + n + " (- a 1) (* b 2)))))\n";
+        else if (kind == "data")
+            s += "(" + n + " -" + n + "7919 " + n + ".25 (1 2 (3 4)) #(5 6) " + n + "e-3)\n";
+        else
+            s += "(\"string number " + n + "\" symbol-" + n + " another-symbol \"x\")\n";
+    }
+    return s;
+}
+
+static void reading(void)
+{
+    const size_t size = 4 * 1024 * 1024;
+    for (const char *kind: { "code", "data", "strings" })
+    {
+        std::string text = corpus(kind, size);
+        time_bytes(std::string("read/") + kind, text.size(), [&text] {
+            reader r(text);
+            lisp_cell sexpr;
+            size_t count = 0;
+            while (r.read(sexpr) == reader::OBJECT)
+                count++;
+            sink = sink + count;
+        });
+    }
+}
+
+static void printing(void)
+{
+    const size_t size = 4 * 1024 * 1024;
+    for (const char *kind: { "code", "data", "strings" })
+    {
+        // read the corpus as one list
+        std::string text = "(" + corpus(kind, size) + ")";
+        lisp_cell list;
+        gc_root root(list);
+        reader r(text);
+        r.read(list);
+
+        std::string out;
+        time_bytes(std::string("print/") + kind, text.size(), [&] {
+            out.clear();
+            printLispObject(out, list);
+            sink = sink + out.size();
+        });
+    }
+}
+
+int main()
+{
+    environment global_env;     add_globals(global_env);
+
+    cells();
+    find_symbol(&global_env);
+    find_symbol_size();
+    dispatch(&global_env);
+    reading();
+    printing();
+}
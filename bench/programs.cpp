@@ -0,0 +1,141 @@
+/* End-to-end benchmark
+ *
+ * Runs standard Lisp programs with the tree walking eval and with the bytecode VM. Every program runs in a child
+ * process of its own, so that its peak RSS is its own, and reports one JSON object per line:
+ *
+ *  {"program": "fib", "engine": "vm", "ms": 27.1, "allocated_bytes": 32, "minor_gcs": 0, "major_gcs": 0,
+ *   "peak_rss_kb": 3968, "result": "75025", "ok": true}
+ *
+ * ms is the best of 'rounds' runs, the other counts are of the last one. allocated_bytes counts the cells and objects
+ * allocated by the garbage collector (see garbage_collector::allocated_bytes), "ok" compares the result with the
+ * expected value.
+ *
+ * usage: bench_programs [program ...]      (default: all programs)
+ */
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "lisp.h"
+
+struct program {
+    const char *name;
+    std::vector<std::string> setup;
+    std::string (*run)(void);                       // the expression to time
+    const char *expected;
+};
+
+// a quoted data literal of about 4 MB: numbers, doubles, strings, symbols and nested lists
+static std::string parse_input(void)
+{
+    std::string s = "(length (quote (";
+    for (int i = 0; i < 40000; i++)
+        s += "(" + std::to_string(i) + " -" + std::to_string(i * 7919) + " 2.5e" + std::to_string(i % 300) +
+             " \"string " + std::to_string(i) + "\" sym-" + std::to_string(i % 1000) + " #(1 2 (3 4)) (((x))))\n";
+    return s + ")))";
+}
+
+const program programs[] = {
+    { "fib",
+      { "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))" },
+      [] { return std::string("(fib 25)"); }, "75025" },
+    { "tak",
+      { "(define tak (lambda (x y z) (if (not (< y x)) z "
+        "(tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)))))" },
+      [] { return std::string("(tak 22 16 8)"); }, "9" },
+    { "ackermann",
+      { "(define ack (lambda (m n) (if (eq m 0) (+ n 1) (if (eq n 0) (ack (- m 1) 1) (ack (- m 1) (ack m (- n 1)))))))" },
+      [] { return std::string("(ack 3 6)"); }, "509" },
+    { "nqueens",
+      { "(define safe (lambda (q d qs) (if (nullp qs) #t (if (eq (car qs) q) #f (if (eq (car qs) (+ q d)) #f "
+        "(if (eq (car qs) (- q d)) #f (safe q (+ d 1) (cdr qs))))))))",
+        "(define queens (lambda (n k qs) (if (eq k n) 1 (place n k qs 0))))",
+        "(define place (lambda (n k qs row) (if (eq row n) 0 "
+        "(+ (if (safe row 1 qs) (queens n (+ k 1) (cons row qs)) 0) (place n k qs (+ row 1))))))" },
+      [] { return std::string("(queens 8 0 (list))"); }, "92" },
+    { "lists",
+      { "(define build (lambda (n acc) (if (eq n 0) acc (build (- n 1) (cons n acc)))))",
+        "(define lists (lambda (i acc) (if (eq i 0) acc "
+        "(lists (- i 1) (length (append (build 1000 (list)) (build 1000 (list))))))))" },
+      [] { return std::string("(lists 500 0)"); }, "2000" },
+    { "closures",
+      { "(define chain (lambda (n f) (if (eq n 0) f (chain (- n 1) (lambda (x) (f (+ x 1)))))))",
+        "(define g (chain 500 (lambda (x) x)))",
+        "(define nest (lambda (a) (lambda (b) (lambda (c) (lambda (d) (lambda (e) (+ a b c d e)))))))",
+        "(define calls (lambda (i acc) (if (eq i 0) acc (calls (- i 1) (+ acc (g i) (((((nest i) 1) 2) 3) 4))))))" },
+      [] { return std::string("(calls 5000 0)"); }, "27555000" },
+    { "parse",
+      {},
+      parse_input, "40000" },
+};
+
+// run 'p' and print its JSON line
+static void run(const program &p, bool vm)
+{
+    const int rounds = 3;
+
+    lisp::use_vm = vm;
+    lisp::environment global_env;     lisp::add_globals(global_env);
+    for (auto &form: p.setup)
+        lisp::eval_string(form, &global_env);
+    std::string text = p.run();
+
+    double best = 0;
+    size_t allocated = 0, minor = 0, major = 0;
+    std::string result;
+    for (int i = 0; i < rounds; i++)
+    {
+        allocated = lisp::gc.allocated_bytes();
+        minor = lisp::gc.minor_collections();
+        major = lisp::gc.collections();
+        auto start = std::chrono::steady_clock::now();
+        lisp::lisp_cell val = lisp::eval_string(text, &global_env);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (i == 0 || elapsed.count() < best)
+            best = elapsed.count();
+        allocated = lisp::gc.allocated_bytes() - allocated;
+        minor = lisp::gc.minor_collections() - minor;
+        major = lisp::gc.collections() - major;
+        result = lisp::printLispObject(val);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "{\"program\": \"" << p.name << "\", \"engine\": \"" << (vm ? "vm" : "eval") << "\", \"ms\": " << best
+              << ", \"allocated_bytes\": " << allocated << ", \"minor_gcs\": " << minor << ", \"major_gcs\": " << major
+              << ", \"peak_rss_kb\": " << usage.ru_maxrss << ", \"result\": \"" << result << "\", \"ok\": "
+              << (result == p.expected ? "true" : "false") << "}" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int status = 0;
+    for (auto &p: programs)
+    {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++)
+            selected |= strcmp(argv[i], p.name) == 0;
+        if (!selected)
+            continue;
+
+        for (bool vm: { false, true })
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                run(p, vm);
+                _exit(0);
+            }
+            int child;
+            if (pid < 0 || waitpid(pid, &child, 0) < 0 || !WIFEXITED(child) || WEXITSTATUS(child) != 0)
+            {
+                std::cerr << p.name << ": failed" << std::endl;
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
@@ -1,7 +1,7 @@
 /*
  * Copyright 2019 Richard Man richard@imagecraft.com. This software is released under the MIT LICENSE. License text reproduced below.
  *
- * cppLISP - Lisp interpreter implemented in modern C++ (C++11, C++14, boost)
+ * cppLISP - Lisp interpreter implemented in modern C++ (C++17)
  *
 **** MIT LICENSE TEXT ****
 Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
@@ -14,921 +14,4606 @@ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLI
 /* cppLisp implements a usable subset of the Lisp programming language. The list of supported built-in functions are in the
  * routine "add_globals", plus "quote" and "lambda".
  *
- * NO GARBAGE COLLECTION is currently implemented. GC using shared_ptr reference counting is expected to be added in a future
- * release.
+ * Memory is managed by a precise generational garbage collector, see "garbage_collector". C++ code holding a lisp value
+ * across anything that may allocate must register it with gc_root.
  *
- * NOTE: "define" creates/updates a variable in the current scope. "setq" only does update.
+ * NOTE: "define" creates/updates a variable in the current scope. "setq" only does update. Inside a lambda body, a
+ * variable "define"d anywhere in the body is local to the whole body, see "Lexical addressing".
+ *
+ * Calls in tail position (of if, begin, and, or and lambda bodies) do not grow the stack, so a loop can be written as
+ * tail recursion. "and" and "or" return the value of the expression that decides them.
+ *
+ * Numbers are integers of any size, or doubles (1.5, -.25, 6.02e23). Arithmetic and comparisons mix them, an integer
+ * meeting a double becomes a double.
+ *
+ * Vectors, #(1 2 3), are fixed size arrays with O(1) access: make-vector, vector, vector-ref, vector-set!,
+ * vector-length, vector->list and list->vector. Symbols may contain - ! ? and > after their first character.
+ *
+ * Hash tables map keys, compared with eq and strings and integers by value, to values: make-hash-table, hash-table-ref,
+ * hash-table-set!, hash-table-delete!, hash-table-contains?, hash-table-count, hash-table-keys, hash-table-values and
+ * hash-table->alist.
+ *
+ * Lambdas are run by the tree walking "eval", or compiled to bytecode and run by a VM when "use_vm" is set (main.cpp
+ * option -vm), see "Bytecode compiler and VM".
  */
 #ifndef LISP_H
 #define LISP_H
 
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <vector>
 #include <list>
-#include <map>
+#include <forward_list>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
 
-#include <boost/variant.hpp>
-#include <boost/algorithm/string.hpp>
 
 namespace lisp {
 
 typedef int64_t lisp_int_t;
 
+class bigint;
 class lisp_cell;
+class lisp_cells;
+class lisp_object;
 class lambda;
+class lambda_code;
+class lisp_proc;
+class lisp_vector;
+class lisp_hash_table;
+class lisp_box;
+class global_ref;
 class symbol;
 class environment;
 
-typedef std::map<std::string, lisp_cell *> sym_map;             // symbol table
-typedef lisp_cell *(*proc_type)(lisp_cell *, environment *);    // primitive functions written in C++
+typedef uint32_t symbol_id;                                      // index of an interned symbol
+typedef lisp_cell (*proc_type)(lisp_cell, environment *);       // primitive functions written in C++
+typedef lisp_cell (*tail_type)(lisp_cell, environment *, bool &); // special forms with an expression in tail position
 
-std::string printLispObject(lisp_cell *sexpr);
-std::string printLispTree(lisp_cell *sexpr);
+std::string printLispObject(lisp_cell sexpr);
+void printLispObject(std::string &out, lisp_cell sexpr);
 
-lisp_cell *eval(lisp_cell *sexpr, environment *env);
+lisp_cell eval(lisp_cell sexpr, environment *env);
+lisp_cell vm_execute(lambda *l, uint32_t nargs);
 
-std::vector<std::string> undefined_symbols;
+std::vector<symbol *> undefined_symbols;
 
-/* lisp_cells is the "cons" data structure, with two fields, car and cdr
+// run lambdas with the bytecode VM instead of the tree walking eval, see vm_execute
+bool use_vm = false;
+
+// end every top-level form of the repl and of load with garbage_collector::end_form
+bool arena_mode = false;
+
+// the number of times a variable bound to a built-in function has been assigned, see compiler
+size_t proc_redefinitions = 0;
+
+// the number of times a symbol has been bound in an environment that may shadow an outer binding of it, or an
+// environment holding symbols has been freed, see global_ref
+size_t binding_epoch = 0;
+
+/* lisp_cell is the lisp node. It is a single 64-bit tagged word (NaN-boxing), so the type of a node is found with one
+ * mask-and-compare, and numbers, booleans and nil live inline without a heap allocation:
+ *
+ *  0x0000 pppp pppp pppt   nullptr (all zero bits), or a 48-bit heap pointer, immediate or local variable reference
+ *                          with a 3-bit tag 't'
+ *  0x0002 .... - 0xFFF2    double, stored as its IEEE-754 bits plus 2^49 (NaNs are canonicalized)
+ *  0xFFFC .... - 0xFFFF    fixnum, a 50-bit two's complement integer in the low 50 bits
+ *
+ * Heap objects are 8-byte aligned, leaving the low 3 bits of a pointer free for the tag. Integers that do not fit
+ * in a fixnum are boxed in a lisp_integer, of any size.
+ *
+ * There is no small integer cache: every integer in the fixnum range is its own immediate, so numeric literals and
+ * the results of integer arithmetic allocate nothing unless they leave the range.
  */
-class lisp_cells {
-    lisp_cell *_car;
-    lisp_cell *_cdr;
+class lisp_cell {
 public:
-    lisp_cells(lisp_cell *car, lisp_cell *cdr): _car(car), _cdr(cdr) {}
-    
-    lisp_cell *car(void) { return _car; }
-    lisp_cell *cdr(void) { return _cdr; }
-};
+    static const uint64_t TAG_MASK       = 0xFFFF000000000007ull;
+    static const uint64_t TAG_CONS       = 1;           // lisp_cells *
+    static const uint64_t TAG_SYMBOL     = 2;           // symbol *
+    static const uint64_t TAG_OBJECT     = 3;           // lisp_object *, any other heap value
+    static const uint64_t TAG_IMMEDIATE  = 4;           // #f, #t, #nil, #error
+    static const uint64_t TAG_LOCAL      = 5;           // reference to a local or captured variable, see resolve
+    static const uint64_t DOUBLE_OFFSET  = 1ull << 49;
+    static const uint64_t FIXNUM_TAG     = 0xFFFC000000000000ull;
+    static const uint64_t FIXNUM_MASK    = (1ull << 50) - 1;
 
-/* lisp_cell is the lisp node
-*/
-class lisp_cell {
+    static const lisp_int_t FIXNUM_MIN   = -(lisp_int_t(1) << 49);
+    static const lisp_int_t FIXNUM_MAX   = (lisp_int_t(1) << 49) - 1;
 
-    // boost::variant is used to store different types of node.
-    boost::variant<
-        lisp_int_t,     // 64-bit int
-        double,         // float/doulbe. NOT IMPLEMENTED
-        std::string,    // std:string is for symbol
-        const char *,   // const char * is for "quoted string"
-        proc_type,      // built-in functions
+    lisp_cell(): bits_(0) {}
+    lisp_cell(std::nullptr_t): bits_(0) {}
 
-        // lisp cells
-        lisp_cells,     // cons cells
-        lambda *        // function definition
-    > node;
+    // cons, allocates a lisp_cells
+    lisp_cell(lisp_cell car, lisp_cell cdr);
 
-public:
-    lisp_cell(lisp_cell *car, lisp_cell *cdr)
-    {
-        lisp_cells cells(car, cdr);
-        node = cells;
-    }
-    
-    lisp_cell(lisp_int_t &n):   node(n) {}
-    lisp_cell(double &d):       node(d) {}
-    lisp_cell(const char *s):   node(s) {}
-    lisp_cell(proc_type p):     node(p) {}
-    lisp_cell(std::string &s):  node(s) {}
-    lisp_cell(lambda *l):       node(l) {}
-    
-    // Variant does not have user-accessible type field. Use this function to get the union type
-    template <typename T>
-    bool getValue(T &value)
-    {
-        if (node.type() == typeid(T))
-        {
-            value = boost::get<T>(node);
-            return true;
-        }
-        return false;
-    }
-    
-    bool isConstant(void)
+    explicit lisp_cell(lisp_int_t n);
+    explicit lisp_cell(const bigint &b);
+    explicit lisp_cell(double d);
+    explicit lisp_cell(std::string_view s);
+    explicit lisp_cell(proc_type p);
+    explicit lisp_cell(lisp_proc *p);
+    explicit lisp_cell(lambda *l);
+    explicit lisp_cell(lambda_code *c);
+    explicit lisp_cell(lisp_vector *v);
+    explicit lisp_cell(lisp_hash_table *h);
+    explicit lisp_cell(lisp_box *b);
+    explicit lisp_cell(global_ref *g);
+    explicit lisp_cell(symbol *s):      bits_(reinterpret_cast<uint64_t>(s) | TAG_SYMBOL) {}
+    explicit lisp_cell(lisp_cells *c):  bits_(reinterpret_cast<uint64_t>(c) | TAG_CONS) {}
+
+    static lisp_cell immediate(uint64_t index)
     {
-        return (node.type() == typeid(lisp_int_t)   ||
-                node.type() == typeid(double)       ||
-                node.type() == typeid(const char *));
+        lisp_cell cell;
+        cell.bits_ = (index << 3) | TAG_IMMEDIATE;
+        return cell;
     }
-       
-    lisp_cell *car(void)
+
+    // the variable in slot 'slot' of the running frame, or the captured variable 'slot' of the running closure
+    static lisp_cell local(bool captured, uint32_t slot)
     {
-        if (isLispCells())
-            return boost::get<lisp_cells>(node).car();
-        return nullptr;
+        lisp_cell cell;
+        cell.bits_ = ((static_cast<uint64_t>(captured) << 32 | slot) << 3) | TAG_LOCAL;
+        return cell;
     }
-    
-    lisp_cell *cdr(void)
+
+    bool operator==(lisp_cell other) const          { return bits_ == other.bits_; }
+    bool operator!=(lisp_cell other) const          { return bits_ != other.bits_; }
+    bool operator==(std::nullptr_t) const           { return bits_ == 0; }
+    bool operator!=(std::nullptr_t) const           { return bits_ != 0; }
+
+    uint64_t bits(void) const                       { return bits_; }
+
+    bool isFixnum(void) const                       { return (bits_ & FIXNUM_TAG) == FIXNUM_TAG; }
+    bool isDouble(void) const                       { return bits_ - DOUBLE_OFFSET < FIXNUM_TAG - DOUBLE_OFFSET; }
+    bool isLispCells(void) const                    { return (bits_ & TAG_MASK) == TAG_CONS; }
+    bool isSymbol(void) const                       { return (bits_ & TAG_MASK) == TAG_SYMBOL; }
+    bool isObject(void) const                       { return (bits_ & TAG_MASK) == TAG_OBJECT; }
+    bool isImmediate(void) const                    { return (bits_ & TAG_MASK) == TAG_IMMEDIATE; }
+    bool isLocal(void) const                        { return (bits_ & TAG_MASK) == TAG_LOCAL; }
+    bool isAtom(void) const                         { return !isLispCells(); }
+
+    bool isObject(int kind) const;
+    bool isConstant(void) const;
+
+    lisp_int_t fixnum(void) const                   { return static_cast<lisp_int_t>(bits_ << 14) >> 14; }
+    double     flonum(void) const
     {
-        if (isLispCells())
-            return boost::get<lisp_cells>(node).cdr();
-        return nullptr;
+        uint64_t raw = bits_ - DOUBLE_OFFSET;
+        double d;
+        memcpy(&d, &raw, sizeof d);
+        return d;
     }
-   
-    bool isAtom(void)                   { return !isLispCells(); }
-    bool isLispCells(void)              { return node.type() == typeid(lisp_cells); }
-    bool isLambda(lambda* &l)           { return getValue<lambda *>(l); }
-    bool isSymbol(std::string &s)       { return getValue<std::string>(s); }
+    lisp_cells  *cells(void) const                  { return reinterpret_cast<lisp_cells *>(bits_ - TAG_CONS); }
+    symbol      *sym(void) const                    { return reinterpret_cast<symbol *>(bits_ - TAG_SYMBOL); }
+    lisp_object *object(void) const                 { return reinterpret_cast<lisp_object *>(bits_ - TAG_OBJECT); }
+    bool         captured(void) const               { return (bits_ >> 35) & 1; }
+    uint32_t     slot(void) const                   { return static_cast<uint32_t>(bits_ >> 3); }
+
+    static bool fitsFixnum(lisp_int_t n)            { return n >= FIXNUM_MIN && n <= FIXNUM_MAX; }
+
+    // Use this function to get the value of the given type. Returns false if the node is of a different type.
+    template <typename T>
+    bool getValue(T &value) const;
+
+    lisp_cell car(void) const;
+    lisp_cell cdr(void) const;
+
+    // cons mutation, with the write barrier
+    void set_car(lisp_cell value) const;
+    void set_cdr(lisp_cell value) const;
+
+    bool isLambda(lambda* &l) const;
+    bool isSymbol(symbol* &s) const;
+    bool isVector(lisp_vector* &v) const;
+
+private:
+    uint64_t bits_;
 };
 
-/* lambda is a function definition. It's derived from lisp_cells with the addition on an
- * environment field, which is the chained symbol tables.
+/* lisp_cells is the "cons" data structure, with two fields, car and cdr
  */
-class lambda: public lisp_cells {
-    environment *env_;
-
+class lisp_cells {
+    lisp_cell _car;
+    lisp_cell _cdr;
 public:
-    lambda(lisp_cell *params, lisp_cell *body, environment *a_env): lisp_cells(params, body), env_(a_env) {}
-    
-    lisp_cell *params(void)             { return car(); }
-    lisp_cell *body(void)               { return cdr(); }
-    
-    environment *env(void)              { return env_; }
+    lisp_cells(lisp_cell car, lisp_cell cdr): _car(car), _cdr(cdr) {}
+
+    lisp_cell car(void) { return _car; }
+    lisp_cell cdr(void) { return _cdr; }
+
+    // no write barrier, use lisp_cell::set_car/set_cdr
+    lisp_cell &car_ref(void) { return _car; }
+    lisp_cell &cdr_ref(void) { return _cdr; }
 };
 
-// Environment is a dictionary that associates symbols with lisp_cells (symbol table), and chain to an "outer" dictionary.
-// The dictionary is implemented as a std::map
-class environment {
+/* Garbage collector
+ *
+ * gc is a precise, generational collector for lisp_cells, lambdas, environments and every other lisp_object.
+ *
+ * Young generation: cons cells are bump-pointer allocated in the nursery. When the nursery is full a minor collection
+ * copies the live cells into the old generation ("promotion") and the nursery is reused from the start. Only the roots
+ * on the live eval stack and the old objects and cells recorded by the write barrier are scanned, so short-lived cells
+ * cost next to nothing. Program text is long-lived and is allocated straight in the old generation by the reader.
+ *
+ * Old generation: a non-moving mark-sweep collector. Memory is carved out of 64 KiB pages, each holding slots of a
+ * single size class, and free slots are kept on one free list per size class. Cons cells have a size class (and pages)
+ * of their own and carry no header: their mark bits live in the page. Objects bigger than the largest size class are
+ * allocated individually. Every lisp_object is allocated in the old generation.
+ *
+ * A major collection is triggered by allocation volume: it runs when the bytes allocated in (or promoted into) the old
+ * generation since the last major collection exceed the bytes that survived it (but at least MIN_THRESHOLD). The roots
+ * are the registered global environments, the symbol table and the live eval stack, i.e. the C++ locals registered with
+ * gc_root. Since a minor collection moves cells, every C++ local holding a lisp value across anything that may allocate
+ * must be registered.
+ *
+ * Write barrier: storing a young cell into an old object or cell must be recorded with write_barrier (environments and
+ * lisp_cell::set_car/set_cdr do this). Objects allocated since the last minor collection are always scanned, so
+ * constructors need no barrier, but neither a constructor nor its arguments may allocate.
+ *
+ * Frame stack: call frames are not heap objects but are pushed on and popped off a stack of memory chunks, see
+ * eval_lambda; closures copy the variables they capture out of them. The frames on it are roots and are scanned by
+ * every collection, so they are never added to the remembered set.
+ */
+class garbage_collector {
 public:
-    environment(environment *outer = 0) : outer_(outer) {}
+    static const size_t PAGE_SIZE       = 64 * 1024;
+    static const size_t NURSERY_SIZE    = 1024 * 1024;
+    static const size_t MIN_THRESHOLD   = 4 * 1024 * 1024;
+    static const size_t NCLASSES        = 8;
+    static const size_t MAX_SMALL       = 256;
+    static const size_t FRAME_CHUNK     = 256 * 1024;
 
-    // create the local frame and bind the arguments to the paramater symbols
-    environment(lisp_cell *params, lisp_cell *args, environment *outer, bool &error): outer_(outer)
+    garbage_collector(): epoch_(false), minor_(false), collecting_(false), allocated_(0), live_(0),
+        threshold_(MIN_THRESHOLD), collections_(0), minor_collections_(0), total_allocated_(0)
     {
-        error = true;
-        if (params == nullptr || args == nullptr)
-        {
-            if (params == nullptr && args != nullptr)
-                std::cout << "Empty parameter list with non-empty argument list." << std::endl;
-            else if (params != nullptr && args == nullptr)
-                std::cout << "Non-empty parameter list with empty argument list." << std::endl;
-            else
-                error = false;
-            return;
-        }
-        std::string param;
-        
-        // Check for special case of one parameter (params is still a list but args is just a single lisp_cell)
-        if (params->car() != nullptr && params->cdr() == nullptr && params->car()->isSymbol(param))
-        {
-            if (args->isLispCells())
-            {
-                env_[param] = eval(args->car(), outer_);
-                if (args->cdr() != nullptr)
-                    std::cout << "Extra argument(s) in argument list" << std::endl;
-            }
-            else
-            {
-                env_[param] = eval(args, outer_);
-                error = false;
-            }
-            return;
-        }
-        
-        // (params) <- (args)
-        while (params != nullptr && args != nullptr)
-        {
+        for (auto &f: free_)
+            f = nullptr;
+        nursery_ = static_cast<char *>(malloc(NURSERY_SIZE));
+        if (nursery_ == nullptr)
+            throw std::bad_alloc();
+        top_ = nursery_;
+        end_ = nursery_ + NURSERY_SIZE;
+        frame_chunk_ = 0;
+        frame_chunks_.push_back(add_frame_chunk(FRAME_CHUNK));
+        frame_top_ = frame_chunks_[0].base;
+        frame_end_ = frame_top_ + FRAME_CHUNK;
+    }
+    ~garbage_collector();
 
-            if (params->isSymbol(param))
-            {
-                env_[param] = eval(args, outer_);
-                params = nullptr;
-                args = args->cdr();
-                break;
-            }
-            if (params->car() != nullptr && params->car()->isSymbol(param) && args->car() != nullptr)
-                env_[param] = eval(args->car(), outer_);
-            params = params->cdr();
-            args = args->cdr();
-        }
-        error = true;
-        if (params != nullptr)
-            std::cout << "insufficient number of argument(s)" << std::endl;
-        else if (args != nullptr)
-            std::cout << "too many argument(s)" << std::endl;
-        else
-            error = false;
+    lisp_cells *allocate_cons(lisp_cell car, lisp_cell cdr);
+    lisp_cells *allocate_old_cons(lisp_cell car, lisp_cell cdr);
+    void *allocate(size_t size);
+    void release(void *p);
+
+    void minor_collect(void);
+    void collect(void);
+    // arena mode: the nursery is the region of a top-level form, see end_form
+    void end_form(void);
+
+    bool is_young(const void *p) const
+    {
+        return reinterpret_cast<uintptr_t>(p) - reinterpret_cast<uintptr_t>(nursery_) < NURSERY_SIZE;
     }
+    bool is_young(lisp_cell cell) const             { return cell.isLispCells() && is_young(cell.cells()); }
 
-    // Symbol lookup. Check the outer env if not found in current one
-    bool FindSymbol(std::string &s, lisp_cell * &lisp_cell)
+    // record an old object or cell that now references a young cell
+    void write_barrier(lisp_object *object, lisp_cell value);
+    void write_barrier(lisp_cells *cells, lisp_cell value)
     {
-        auto iter = env_.find(s);
-        if (iter != env_.end())
-        {
-            lisp_cell = iter->second;
-            return true;
-        }
-        if (outer_)
-            return outer_->FindSymbol(s, lisp_cell);
-        
-        if (std::find(undefined_symbols.begin(), undefined_symbols.end(), s) == undefined_symbols.end())
+        if (is_young(value) && !is_young(cells))
+            remembered_cells_.push_back(cells);
+    }
+    void remember(lisp_object *object);
+
+    // frame stack, LIFO. allocate_frame reserves the memory of a frame, which is then constructed and registered with
+    // push_frame. pop_frame destroys the most recently pushed frame and gives its memory back.
+    void *allocate_frame(size_t size);
+    void push_frame(lisp_object *frame);
+    void pop_frame(void);
+
+    // argument stack, the evaluated arguments of a call until they are bound to its frame, and the operand stack of
+    // the VM. Its cells are roots.
+    std::vector<lisp_cell> &argument_stack(void)    { return arguments_; }
+    void push_argument(lisp_cell cell)              { arguments_.push_back(cell); }
+    lisp_cell *top_arguments(size_t n)              { return arguments_.data() + arguments_.size() - n; }
+    void pop_arguments(size_t n)                    { arguments_.resize(arguments_.size() - n); }
+
+    // roots
+    void add_root(lisp_object *object)              { roots_.push_back(object); }
+    void push_root(lisp_cell *cell)                 { cell_roots_.push_back(cell); }
+    template <typename T>
+    void push_root(T **object)
+    {
+        object_roots_.push_back({object, [](void *p) -> lisp_object * { return *static_cast<T **>(p); }});
+    }
+    void pop_roots(size_t ncells, size_t nobjects)
+    {
+        cell_roots_.resize(cell_roots_.size() - ncells);
+        object_roots_.resize(object_roots_.size() - nobjects);
+    }
+
+    // called from lisp_object::trace for every reference. A major collection marks the referenced value, a minor
+    // collection promotes it if it is a young cell and updates the reference.
+    void mark(lisp_cell &cell);
+    void mark(lisp_object *object);
+
+    // an object is marked when its mark flag equals the epoch of the current collection
+    bool epoch(void) const                          { return epoch_; }
+
+    size_t collections(void) const                 { return collections_; }
+    size_t minor_collections(void) const           { return minor_collections_; }
+    size_t live_bytes(void) const                   { return live_; }
+    // bytes allocated since the start, young cells and old objects and cells, not counting promotion
+    size_t allocated_bytes(void) const              { return total_allocated_ + (top_ - nursery_); }
+
+private:
+    struct page {
+        uint32_t slot_size;
+        uint32_t nslots;
+        uint64_t allocated[PAGE_SIZE / 16 / 64];
+        uint64_t marked[PAGE_SIZE / 16 / 64];
+
+        static size_t header_size(void)             { return (sizeof(page) + 15) & ~size_t(15); }
+        char *slot(size_t i)                        { return reinterpret_cast<char *>(this) + header_size() + i * slot_size; }
+        size_t index(const void *p)
         {
-            // eval might be called multiple times, e.g. proc_arith_impl/proc_compare_impl.
-            // Using undefined_symbols eliminates multiple error messages.
-            std::cout << "Undefined symbol '" << s << "'" << std::endl;
-            undefined_symbols.push_back(s);
+            return (static_cast<const char *>(p) - reinterpret_cast<char *>(this) - header_size()) / slot_size;
         }
-        return false;
+        static bool test(const uint64_t *bits, size_t i)    { return (bits[i / 64] >> (i % 64)) & 1; }
+        static void set(uint64_t *bits, size_t i)           { bits[i / 64] |= uint64_t(1) << (i % 64); }
+        static void clear(uint64_t *bits, size_t i)         { bits[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+    };
+
+    struct object_root {
+        void *address;
+        lisp_object *(*get)(void *);
+    };
+
+    struct frame_chunk {
+        char *base;
+        size_t size;
+    };
+    static frame_chunk add_frame_chunk(size_t size)
+    {
+        char *base = static_cast<char *>(malloc(size));
+        if (base == nullptr)
+            throw std::bad_alloc();
+        return {base, size};
     }
 
-    // Update a symbol definition. "current_scope_only" is to disambiguate between "define" and "setq".
-    // define always updates in current scope (and creates the symbol if needed), and setq will only
-    // update if the symbol already exists (i.e. created by using define.
-    bool UpdateSymbol(std::string &s, lisp_cell *lisp_cell, bool current_scope_only)
+    static page *page_of(const void *p)
     {
-        bool result = true;
-        auto iter = env_.find(s);
-        
-        // symbol exists, just update its value
-        if (iter != env_.end())
-            iter->second = lisp_cell;
-        // define, always update/add in current scope
-        else if (current_scope_only)
-            env_[s] = lisp_cell;
-        // set! only add if symbol exists in some scope
-        else if (outer_)
-            return outer_->UpdateSymbol(s, lisp_cell, false);
-        else
-            result = false;
-        return result;
+        return reinterpret_cast<page *>(reinterpret_cast<uintptr_t>(p) & ~uintptr_t(PAGE_SIZE - 1));
+    }
+    static size_t size_class(size_t size);
+
+    void *allocate_slot(size_t cls);
+    void add_page(size_t cls);
+    bool should_collect(size_t size)
+    {
+        allocated_ += size;
+        total_allocated_ += size;
+        return allocated_ > threshold_ && !collecting_;
     }
+    void promote(lisp_cell &cell);
+    void drain(void);
+    void sweep(void);
+
+    static const uint32_t class_sizes_[NCLASSES];
+
+    bool epoch_;
+    bool minor_;                                    // a minor collection is running
+    bool collecting_;
+    size_t allocated_;                              // bytes allocated in the old generation since the last collection
+    size_t live_;                                   // bytes that survived the last collection
+    size_t threshold_;
+    size_t collections_;
+    size_t minor_collections_;
+    size_t total_allocated_;                        // see allocated_bytes, up to the last minor collection
+
+    char *nursery_;                                 // young generation
+    char *top_;
+    char *end_;
+
+    void *free_[NCLASSES];                          // free list per size class, threaded through the free slots
+    std::vector<page *> pages_[NCLASSES];
+    struct large_object {
+        lisp_object *object;
+        size_t size;
+    };
+    std::vector<large_object> large_;               // objects bigger than MAX_SMALL
+
+    std::vector<lisp_object *> roots_;              // global environments
+    std::vector<lisp_cell *> cell_roots_;           // live eval stack
+    std::vector<object_root> object_roots_;
+
+    std::vector<lisp_object *> new_objects_;        // allocated since the last minor collection
+    std::vector<lisp_object *> remembered_objects_; // old objects and cells referencing young cells
+    std::vector<lisp_cells *> remembered_cells_;
+
+    std::vector<lisp_cells *> mark_cells_;          // mark stack, or promoted cells still to be scanned
+    std::vector<lisp_object *> mark_objects_;
 
-    // return a reference to the cell associated with the given symbol 'var' in current environment
-    lisp_cell * &operator[] (const std::string& var)
+    std::vector<frame_chunk> frame_chunks_;         // frame stack
+    size_t frame_chunk_;                            // the chunk holding frame_top_
+    char *frame_top_;
+    char *frame_end_;
+    std::vector<lisp_object *> frames_;             // the frames on the frame stack, oldest first
+    std::vector<lisp_cell> arguments_;              // argument stack
+};
+
+const uint32_t garbage_collector::class_sizes_[NCLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+
+garbage_collector gc;
+
+/* gc_root registers C++ locals holding lisp values (lisp_cell, or a pointer to a lisp_object) as roots for its own
+ * lifetime, e.g. gc_root root(car, new_env);
+ */
+class gc_root {
+public:
+    template <typename... T>
+    explicit gc_root(T &... vars): ncells_(0), nobjects_(0)
     {
-        return env_[var];
+        int expand[] = { 0, (add(vars), 0)... };
+        (void)expand;
     }
-    
+    ~gc_root()                                      { gc.pop_roots(ncells_, nobjects_); }
+
+    gc_root(const gc_root &) = delete;
+    gc_root &operator=(const gc_root &) = delete;
+
 private:
-    sym_map env_;           // inner symbol->cell mapping
-    environment *outer_;    // next adjacent outer env, or 0 if there are no further environments
+    void add(lisp_cell &cell)                       { gc.push_root(&cell); ncells_++; }
+    template <typename T>
+    void add(T *&object)                            { gc.push_root(&object); nobjects_++; }
+
+    size_t ncells_;
+    size_t nobjects_;
+};
+
+/* lisp_object is the base of every heap node other than the cons cell. "kind" identifies the derived class.
+ * Objects are allocated from the garbage collected heap.
+ */
+class lisp_object {
+public:
+    enum kind_t : uint8_t {
+        SYMBOL,         // symbol
+        STRING,         // "quoted string"
+        PROC,           // built-in functions
+        LAMBDA,         // function definition
+        CODE,           // resolved lambda form, see resolve
+        INTEGER,        // integer too big for a fixnum
+        VECTOR,         // #(...)
+        HASH_TABLE,     // make-hash-table
+        ENVIRONMENT,    // symbol table
+        BOX,            // variable shared by a frame and closures, see resolve
+        GLOBAL          // global function called by a resolved lambda body, see global_ref
+    };
+    const kind_t kind;
+    bool marked;
+    bool remembered;        // in the write barrier's remembered set
+
+    explicit lisp_object(kind_t k): kind(k), marked(gc.epoch()), remembered(false) {}
+    virtual ~lisp_object() {}
+
+    // mark the lisp values referenced by this object, see garbage_collector::mark
+    virtual void trace(void) {}
+
+    static void *operator new(size_t size);
+    static void operator delete(void *p);
+};
+
+/* symbol is unique per name: the reader interns every symbol it reads, so two symbols are the same symbol exactly when
+ * their pointers are equal. "id" is a small integer used as the symbol table key.
+ */
+class symbol: public lisp_object {
+    std::string name_;
+    symbol_id id_;
+public:
+    symbol(const std::string &name, symbol_id id): lisp_object(SYMBOL), name_(name), id_(id) {}
+
+    const std::string &name(void) const { return name_; }
+    symbol_id id(void) const            { return id_; }
 };
 
-lisp_cell *make_builtin_symbol(const char *s)
+// the intern table, name -> unique symbol. The keys are views of the names of the symbols, which never move.
+std::unordered_map<std::string_view, symbol *> &symbol_table(void)
 {
-    auto str = new std::string(s);
-    return new lisp_cell(*str);
+    static std::unordered_map<std::string_view, symbol *> table;
+    return table;
 }
 
-lisp_cell *false_sexpr = make_builtin_symbol("#f");
-lisp_cell *true_sexpr  = make_builtin_symbol("#t");
-lisp_cell *nil_sexpr   = make_builtin_symbol("#nil");
-lisp_cell *bad_sexpr   = make_builtin_symbol("#error");
-
-// Primitive Operations
-bool hasTwoOperands(lisp_cell *sexpr)
+// return the unique symbol with the given name, creating it on first use
+symbol *intern(std::string_view name)
 {
-    if (sexpr == nullptr || sexpr->car() == nullptr || sexpr->cdr() == nullptr)
-        return false;
-    return true;
+    auto &table = symbol_table();
+    auto iter = table.find(name);
+    if (iter != table.end())
+        return iter->second;
+    symbol *sym = new symbol(std::string(name), static_cast<symbol_id>(table.size()));
+    table.emplace(sym->name(), sym);
+    return sym;
 }
 
-typedef lisp_int_t (*binop_func)(lisp_int_t, lisp_int_t);
-typedef bool       (*cmpop_func)(lisp_int_t, lisp_int_t);
+symbol *const sym_quote  = intern("quote");
+symbol *const sym_lambda = intern("lambda");
+symbol *const sym_define = intern("define");
+symbol *const sym_setq   = intern("setq");
 
-// Arithmetic Primitives
-bool proc_arith_impl(lisp_cell *sexpr, lisp_int_t &n, environment *env, binop_func Op)
-{
-    if (sexpr == nullptr)
-        return false;
-    
-    if (sexpr->isAtom())
-        return sexpr->getValue<lisp_int_t>(n);
-    
-    lisp_int_t n1;
-    if (proc_arith_impl(eval(sexpr->car(), env), n1, env, Op) == false)
-        return false;
-    
-    if (sexpr->cdr() == nullptr)
+class lisp_string: public lisp_object {
+    char *text_;
+public:
+    explicit lisp_string(std::string_view text): lisp_object(STRING), text_(static_cast<char *>(malloc(text.size() + 1)))
     {
-        n = n1;
-        return true;
+        if (text_ == nullptr)
+            throw std::bad_alloc();
+        memcpy(text_, text.data(), text.size());
+        text_[text.size()] = 0;
     }
-    lisp_int_t n2;
-    
-    // binop primitives (+-*/) can have a list of operands, e.g. (+ 1 2 3 4). Internally
-    // it's still just a lisp cons tree.
-    //
-    // the inner nodes maybe an op, so it needs to be eval'ed, or
-    // it could be atoms, which can be resolved if we recursive call the function
-    // without evaluting it,
-    lisp_cell *cdrval = eval(sexpr->cdr(), env);
-    
-    if (cdrval != nullptr && cdrval->getValue<lisp_int_t>(n2))
-    {
-        n = Op(n1, n2);
-        return true;
-    }
-    
-    if (proc_arith_impl(sexpr->cdr(), n2, env, Op) == false)
-        return false;
-    
-    n = Op(n1, n2);
-    return true;
-    
-}
+    ~lisp_string()                      { free(text_); }
 
-lisp_cell *proc_arith_main(lisp_cell *sexpr, environment *env, binop_func Op)
-{
-    lisp_int_t n;
-    if (proc_arith_impl(sexpr, n, env, Op))
-        return new lisp_cell(n);
-    return false_sexpr;
-}
+    const char *text(void) const { return text_; }
+};
 
-lisp_cell *proc_add(lisp_cell *sexpr, environment *env)
-{
-    return proc_arith_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1+n2;});
-}
+/* lisp_proc is a built-in function. A special form with an expression in tail position (if, begin...) has a "tail"
+ * function as well, which does the work up to that expression and returns it, for eval to evaluate in its loop.
+ */
+class lisp_proc: public lisp_object {
+    proc_type func_;
+    tail_type tail_;
+public:
+    explicit lisp_proc(proc_type func, tail_type tail = nullptr): lisp_object(PROC), func_(func), tail_(tail) {}
 
-lisp_cell *proc_sub(lisp_cell *sexpr, environment *env)
-{
-    return proc_arith_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1-n2;});
-}
+    proc_type func(void) const { return func_; }
+    tail_type tail(void) const { return tail_; }
+};
+
+/* bigint is an arbitrary precision integer: a sign and a magnitude of 32-bit digits, least significant first, with no
+ * leading zero digits (zero has no digits and is not negative). It is the value of a lisp_integer, and the arithmetic
+ * primitives continue in bigints when a lisp_int_t operation overflows.
+ */
+class bigint {
+public:
+    bigint(): negative_(false) {}
+    explicit bigint(lisp_int_t n);
+
+    // the digits in 'digits', in base 10 or 16
+    static bigint parse(std::string_view digits, int base, bool negative);
+
+    bool is_zero(void) const                        { return digits_.empty(); }
+    bool is_negative(void) const                    { return negative_; }
+
+    // false if the value does not fit in a lisp_int_t
+    bool get(lisp_int_t &n) const;
+    double to_double(void) const;
+    std::string to_string(void) const;
+
+    // less than zero, zero or greater than zero as this is less than, equal to or greater than 'other'
+    int compare(const bigint &other) const;
+    uint64_t hash(void) const;
+
+    bigint operator+(const bigint &other) const;
+    bigint operator-(const bigint &other) const;
+    bigint operator*(const bigint &other) const;
+
+    // the quotient truncated towards zero, and the remainder with the sign of the dividend. 'divisor' is not zero.
+    static void divmod(const bigint &dividend, const bigint &divisor, bigint &quotient, bigint &remainder);
+
+private:
+    typedef std::vector<uint32_t> digits;
 
-lisp_cell *proc_mul(lisp_cell *sexpr, environment *env)
+    bool negative_;
+    digits digits_;
+
+    void trim(void);
+
+    static int compare_digits(const digits &a, const digits &b);
+    static digits add_digits(const digits &a, const digits &b);
+    static digits sub_digits(const digits &a, const digits &b);
+    static digits mul_digits(const digits &a, const digits &b);
+    static uint32_t divmod_digit(digits &a, uint32_t b);
+    static void divmod_digits(const digits &a, const digits &b, digits &q, digits &r);
+};
+
+inline bigint::bigint(lisp_int_t n): negative_(n < 0)
 {
-    return proc_arith_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1*n2;});
+    uint64_t m = negative_ ? 0 - static_cast<uint64_t>(n) : static_cast<uint64_t>(n);
+    for (; m != 0; m >>= 32)
+        digits_.push_back(static_cast<uint32_t>(m));
 }
 
-lisp_cell *proc_div(lisp_cell *sexpr, environment *env)
+bigint bigint::parse(std::string_view digits, int base, bool negative)
 {
-    return proc_arith_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1/n2;});
+    bigint b;
+    // b = b * base + digit
+    for (char c: digits)
+    {
+        if (!isxdigit(c))
+            break;
+        uint64_t carry = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        for (auto &d: b.digits_)
+        {
+            uint64_t t = uint64_t(d) * base + carry;
+            d = static_cast<uint32_t>(t);
+            carry = t >> 32;
+        }
+        if (carry != 0)
+            b.digits_.push_back(static_cast<uint32_t>(carry));
+    }
+    b.negative_ = negative;
+    b.trim();
+    return b;
 }
 
-// Relational Primitives
-bool proc_compare_impl(lisp_cell *sexpr, lisp_int_t &n, environment *env, cmpop_func Op)
+bool bigint::get(lisp_int_t &n) const
 {
-    if (sexpr == nullptr)
+    if (digits_.size() > 2)
         return false;
-    
-    if (sexpr->isAtom())
-        return sexpr->getValue<lisp_int_t>(n);
-    
-    if (proc_compare_impl(eval(sexpr->car(), env), n, env, Op) == false)
-        return false;
-    
-    if (sexpr->cdr() == nullptr)
-        return true;
-    
-    lisp_int_t n2;
-    // see comments in proc_arith_impl on how to handle multi-operand primitives
-    lisp_cell *cdrval = eval(sexpr->cdr(), env);
-     
-    if (cdrval != nullptr && cdrval->getValue<lisp_int_t>(n2))
-        return Op(n, n2);
-     
-    if (proc_compare_impl(sexpr->cdr(), n2, env, Op) == false)
+    uint64_t m = 0;
+    for (size_t i = digits_.size(); i-- > 0; )
+        m = m << 32 | digits_[i];
+    if (m > (negative_ ? uint64_t(1) << 63 : (uint64_t(1) << 63) - 1))
         return false;
-    return Op(n, n2);
+    n = static_cast<lisp_int_t>(negative_ ? 0 - m : m);
+    return true;
 }
 
-lisp_cell *proc_compare_main(lisp_cell *sexpr, environment *env, cmpop_func Op)
+double bigint::to_double(void) const
 {
-    lisp_int_t n;
-    if (proc_compare_impl(sexpr, n, env, Op))
-        return true_sexpr;
-    return false_sexpr;
+    double d = 0;
+    for (size_t i = digits_.size(); i-- > 0; )
+        d = d * 4294967296.0 + digits_[i];
+    return negative_ ? -d : d;
 }
 
-lisp_cell *proc_cmpgt(lisp_cell *sexpr, environment *env)
+std::string bigint::to_string(void) const
 {
-    return proc_compare_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1>n2;});
-}
+    if (is_zero())
+        return "0";
 
-lisp_cell *proc_cmpge(lisp_cell *sexpr, environment *env)
-{
-    return proc_compare_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1>=n2;});
-}
+    // nine decimal digits at a time, least significant first
+    std::vector<uint32_t> chunks;
+    digits m = digits_;
+    while (!m.empty())
+        chunks.push_back(divmod_digit(m, 1000000000));
 
-lisp_cell *proc_cmplt(lisp_cell *sexpr, environment *env)
-{
-    return proc_compare_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1<n2;});
+    std::string s = negative_ ? "-" : "";
+    char buf[16];
+    sprintf(buf, "%u", chunks.back());
+    s += buf;
+    for (size_t i = chunks.size() - 1; i-- > 0; )
+    {
+        sprintf(buf, "%09u", chunks[i]);
+        s += buf;
+    }
+    return s;
 }
 
-lisp_cell *proc_cmple(lisp_cell *sexpr, environment *env)
+int bigint::compare(const bigint &other) const
 {
-    return proc_compare_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1<=n2;});
+    if (negative_ != other.negative_)
+        return negative_ ? -1 : 1;
+    int c = compare_digits(digits_, other.digits_);
+    return negative_ ? -c : c;
 }
 
-lisp_cell *proc_cmpeq(lisp_cell *sexpr, environment *env)
+uint64_t bigint::hash(void) const
 {
-    return proc_compare_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1==n2;});
+    uint64_t h = negative_;
+    for (uint32_t d: digits_)
+        h = h * 1000003 ^ d;
+    return h;
 }
 
-lisp_cell *proc_cmpne(lisp_cell *sexpr, environment *env)
+bigint bigint::operator+(const bigint &other) const
 {
-    return proc_compare_main(sexpr, env, [](lisp_int_t n1, lisp_int_t n2) { return n1!=n2;});
+    bigint sum;
+    if (negative_ == other.negative_)
+    {
+        sum.digits_ = add_digits(digits_, other.digits_);
+        sum.negative_ = negative_;
+    }
+    else if (compare_digits(digits_, other.digits_) >= 0)
+    {
+        sum.digits_ = sub_digits(digits_, other.digits_);
+        sum.negative_ = negative_;
+    }
+    else
+    {
+        sum.digits_ = sub_digits(other.digits_, digits_);
+        sum.negative_ = other.negative_;
+    }
+    sum.trim();
+    return sum;
 }
 
-// List Processing
-lisp_cell *eval_car(lisp_cell *sexpr, environment *env)
+bigint bigint::operator-(const bigint &other) const
 {
-    if (sexpr == nullptr)
-        return nil_sexpr;
-    sexpr = eval(sexpr, env);
-    if (sexpr == nullptr || sexpr->isAtom())
-        return bad_sexpr;
-    return sexpr->car();
+    bigint negated = other;
+    negated.negative_ = !other.negative_;
+    negated.trim();
+    return *this + negated;
 }
 
-lisp_cell *eval_cdr(lisp_cell *sexpr, environment *env)
+bigint bigint::operator*(const bigint &other) const
 {
-    if (sexpr == nullptr)
-        return nil_sexpr;
-    sexpr = eval(sexpr, env);
-    if (sexpr == nullptr || sexpr->isAtom())
-        return bad_sexpr;
-    return sexpr->cdr();
+    bigint product;
+    product.digits_ = mul_digits(digits_, other.digits_);
+    product.negative_ = negative_ != other.negative_;
+    product.trim();
+    return product;
 }
 
-lisp_cell *eval_cons(lisp_cell *sexpr, environment *env)
+void bigint::divmod(const bigint &dividend, const bigint &divisor, bigint &quotient, bigint &remainder)
 {
-    lisp_cell *car = eval(sexpr->car(), env);
-    lisp_cell *cdr = eval(sexpr->cdr(), env);
-    return new lisp_cell(car, cdr);
+    divmod_digits(dividend.digits_, divisor.digits_, quotient.digits_, remainder.digits_);
+    quotient.negative_ = dividend.negative_ != divisor.negative_;
+    remainder.negative_ = dividend.negative_;
+    quotient.trim();
+    remainder.trim();
 }
 
-lisp_cell *eval_append_impl(lisp_cell *p, lisp_cell *tail)
+void bigint::trim(void)
 {
-    if (p == nullptr)
-        return tail;
-    if (p->isAtom())
-        return new lisp_cell(p, tail);
-    return new lisp_cell(p->car(), eval_append_impl(p->cdr(), tail));
+    while (!digits_.empty() && digits_.back() == 0)
+        digits_.pop_back();
+    if (digits_.empty())
+        negative_ = false;
 }
 
-lisp_cell *eval_append(lisp_cell *sexpr, environment *env)
+int bigint::compare_digits(const digits &a, const digits &b)
 {
-    lisp_cell *val = eval(sexpr->car(), env);
-    if (val == nullptr || val->isAtom())
-        return nil_sexpr;
-    
-    lisp_cell *tail = eval(sexpr->cdr(), env);
-    if (tail == nullptr || tail == nil_sexpr)
-        return val;
-    
-    return eval_append_impl(val, tail);
+    if (a.size() != b.size())
+        return a.size() < b.size() ? -1 : 1;
+    for (size_t i = a.size(); i-- > 0; )
+        if (a[i] != b[i])
+            return a[i] < b[i] ? -1 : 1;
+    return 0;
 }
 
-lisp_int_t eval_length_impl(lisp_cell *sexpr)
+bigint::digits bigint::add_digits(const digits &a, const digits &b)
 {
-    if (sexpr == nullptr)
-        return 0;
-    if (sexpr->isAtom())
-        return 1;
-    return eval_length_impl(sexpr->car()) + eval_length_impl(sexpr->cdr());
+    const digits &longer = a.size() >= b.size() ? a : b;
+    const digits &shorter = a.size() >= b.size() ? b : a;
+    digits sum(longer.size() + 1);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < longer.size(); i++)
+    {
+        uint64_t t = uint64_t(longer[i]) + (i < shorter.size() ? shorter[i] : 0) + carry;
+        sum[i] = static_cast<uint32_t>(t);
+        carry = t >> 32;
+    }
+    sum[longer.size()] = static_cast<uint32_t>(carry);
+    return sum;
 }
 
-lisp_cell *eval_length(lisp_cell *sexpr, environment *env)
+// a - b, a >= b
+bigint::digits bigint::sub_digits(const digits &a, const digits &b)
 {
-    lisp_cell *val = eval(sexpr, env);
-    lisp_int_t n = eval_length_impl(val);
-    
-    return new lisp_cell(n);
+    digits difference(a.size());
+    int64_t borrow = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        int64_t t = int64_t(a[i]) - (i < b.size() ? b[i] : 0) - borrow;
+        borrow = t < 0;
+        difference[i] = static_cast<uint32_t>(t);
+    }
+    return difference;
 }
 
-lisp_cell *eval_nullp(lisp_cell *sexpr, environment *env)
+bigint::digits bigint::mul_digits(const digits &a, const digits &b)
 {
-    lisp_cell *val = eval(sexpr, env);
-    if (val == nullptr || val == nil_sexpr)
-        return true_sexpr;
-    return false_sexpr;
+    digits product(a.size() + b.size());
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b.size(); j++)
+        {
+            uint64_t t = uint64_t(a[i]) * b[j] + product[i + j] + carry;
+            product[i + j] = static_cast<uint32_t>(t);
+            carry = t >> 32;
+        }
+        product[i + b.size()] = static_cast<uint32_t>(carry);
+    }
+    return product;
 }
 
-lisp_cell *eval_not(lisp_cell *sexpr, environment *env)
+// a /= b, returns the remainder
+uint32_t bigint::divmod_digit(digits &a, uint32_t b)
 {
-    lisp_cell *val = eval(sexpr, env);
-    if (val == nullptr || val == nil_sexpr || val == false_sexpr)
-        return true_sexpr;
-    return false_sexpr;
+    uint64_t remainder = 0;
+    for (size_t i = a.size(); i-- > 0; )
+    {
+        uint64_t t = remainder << 32 | a[i];
+        a[i] = static_cast<uint32_t>(t / b);
+        remainder = t % b;
+    }
+    while (!a.empty() && a.back() == 0)
+        a.pop_back();
+    return static_cast<uint32_t>(remainder);
 }
 
-lisp_cell *eval_and(lisp_cell *sexpr, environment *env)
+// q = a / b and r = a % b, b is not zero. Knuth's algorithm D, after Hacker's Delight "divmnu".
+void bigint::divmod_digits(const digits &a, const digits &b, digits &q, digits &r)
 {
-    if (sexpr == nullptr)
-        return false_sexpr;
-    
-    lisp_cell *val;
-    if (sexpr->isAtom())
+    if (compare_digits(a, b) < 0)
     {
-        val = eval(sexpr, env);
-        return val == false_sexpr? false_sexpr : true_sexpr;
+        q.clear();
+        r = a;
+        return;
     }
-    
-    lisp_cell *car = eval_and(sexpr->car(), env);
-    if (car == true_sexpr)
-        return eval_and(sexpr->cdr(), env);
-    return false_sexpr;
-}
-    
-lisp_cell *eval_or(lisp_cell *sexpr, environment *env)
+    if (b.size() == 1)
+    {
+        q = a;
+        uint32_t remainder = divmod_digit(q, b[0]);
+        r.assign(1, remainder);
+        return;
+    }
+
+    // normalize, so that the top digit of the divisor has its high bit set
+    const uint64_t base = uint64_t(1) << 32;
+    size_t n = b.size(), m = a.size() - n;
+    int s = 0;
+    for (uint32_t top = b.back(); (top & 0x80000000u) == 0; top <<= 1)
+        s++;
+    digits v(n), u(a.size() + 1);
+    for (size_t i = n - 1; i > 0; i--)
+        v[i] = static_cast<uint32_t>(uint64_t(b[i]) << s | uint64_t(b[i - 1]) >> (32 - s));
+    v[0] = b[0] << s;
+    u[a.size()] = static_cast<uint32_t>(uint64_t(a.back()) >> (32 - s));
+    for (size_t i = a.size() - 1; i > 0; i--)
+        u[i] = static_cast<uint32_t>(uint64_t(a[i]) << s | uint64_t(a[i - 1]) >> (32 - s));
+    u[0] = a[0] << s;
+
+    q.assign(m + 1, 0);
+    for (size_t j = m + 1; j-- > 0; )
+    {
+        // estimate the quotient digit from the top two digits, it is at most 2 too large
+        uint64_t top = uint64_t(u[j + n]) << 32 | u[j + n - 1];
+        uint64_t qhat = top / v[n - 1], rhat = top % v[n - 1];
+        while (qhat >= base || qhat * v[n - 2] > (rhat << 32 | u[j + n - 2]))
+        {
+            qhat--;
+            rhat += v[n - 1];
+            if (rhat >= base)
+                break;
+        }
+
+        // u -= qhat * v
+        uint64_t carry = 0;
+        int64_t borrow = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t p = qhat * v[i] + carry;
+            carry = p >> 32;
+            int64_t t = int64_t(u[i + j]) - int64_t(p & 0xFFFFFFFF) - borrow;
+            u[i + j] = static_cast<uint32_t>(t);
+            borrow = t < 0;
+        }
+        int64_t t = int64_t(u[j + n]) - int64_t(carry) - borrow;
+        u[j + n] = static_cast<uint32_t>(t);
+
+        // qhat was one too large, add v back
+        q[j] = static_cast<uint32_t>(qhat);
+        if (t < 0)
+        {
+            q[j]--;
+            carry = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                uint64_t sum = uint64_t(u[i + j]) + v[i] + carry;
+                u[i + j] = static_cast<uint32_t>(sum);
+                carry = sum >> 32;
+            }
+            u[j + n] += static_cast<uint32_t>(carry);
+        }
+    }
+
+    // unnormalize the remainder
+    r.resize(n);
+    for (size_t i = 0; i < n; i++)
+        r[i] = static_cast<uint32_t>(uint64_t(u[i]) >> s | uint64_t(u[i + 1]) << (32 - s));
+}
+
+class lisp_integer: public lisp_object {
+    bigint value_;
+public:
+    explicit lisp_integer(const bigint &value): lisp_object(INTEGER), value_(value) {}
+
+    const bigint &value(void) const { return value_; }
+};
+
+/* lisp_vector is a fixed size array of lisp values, stored contiguously right after the object like the slots of a
+ * frame. Allocate with new (size) lisp_vector(size), the elements start as #nil. The size must be at most MAX_SIZE.
+ */
+class lisp_vector: public lisp_object {
+public:
+    // 2 GB of elements: the allocation size cannot overflow, and a larger request is an error rather than an
+    // out of memory abort
+    static const size_t MAX_SIZE = size_t(1) << 28;
+
+    explicit lisp_vector(size_t size);
+
+    using lisp_object::operator new;
+    using lisp_object::operator delete;
+    static void *operator new(size_t size, size_t nelements)
+    {
+        return lisp_object::operator new(size + nelements * sizeof(lisp_cell));
+    }
+    static void operator delete(void *p, size_t)
+    {
+        lisp_object::operator delete(p);
+    }
+
+    size_t size(void) const             { return size_; }
+    lisp_cell get(size_t i) const       { return elements()[i]; }
+    void set(size_t i, lisp_cell value)
+    {
+        elements()[i] = value;
+        gc.write_barrier(this, value);
+    }
+
+    void trace(void) override
+    {
+        for (size_t i = 0; i < size_; i++)
+            gc.mark(elements()[i]);
+    }
+
+private:
+    lisp_cell *elements(void)               { return reinterpret_cast<lisp_cell *>(this + 1); }
+    const lisp_cell *elements(void) const   { return reinterpret_cast<const lisp_cell *>(this + 1); }
+
+    size_t size_;
+};
+
+/* lisp_hash_table maps keys to values with open addressing: a single array of entries, probed linearly, with backward
+ * shift deletion so there are no tombstones. Keys are compared with eq, except that strings and big integers are the
+ * same key when they have the same value. The capacity is a power of 2, grown to keep the table at most 3/4 full.
+ *
+ * A key that is a young cons cell moves when it is promoted, which changes its hash. The table rehashes on its first
+ * use after a minor collection that may have moved one.
+ */
+class lisp_hash_table: public lisp_object {
+public:
+    // the largest size a table can be made with room for, 16M entries in 768 MB
+    static const size_t MAX_PRESIZE = size_t(1) << 24;
+
+    // room for 'size' entries before the table grows, 'size' is at most MAX_PRESIZE
+    explicit lisp_hash_table(size_t size = 0);
+
+    bool find(lisp_cell key, lisp_cell &value);
+    void insert(lisp_cell key, lisp_cell value);
+    bool remove(lisp_cell key);
+    size_t count(void) const            { return count_; }
+
+    // iteration, entry i is in use if its key is not unbound_sexpr
+    size_t capacity(void) const         { return entries_.size(); }
+    lisp_cell key(size_t i) const       { return entries_[i].key; }
+    lisp_cell value(size_t i) const     { return entries_[i].value; }
+
+    void trace(void) override
+    {
+        for (auto &e: entries_)
+        {
+            gc.mark(e.key);
+            gc.mark(e.value);
+        }
+    }
+
+private:
+    struct entry {
+        uint64_t hash;
+        lisp_cell key;
+        lisp_cell value;
+    };
+
+    static uint64_t hash(lisp_cell key);
+    static bool equal(lisp_cell a, lisp_cell b);
+    size_t lookup(lisp_cell key, uint64_t h) const;
+    void resize(size_t capacity);
+    void note_young(lisp_cell key);
+    void rehash_moved(void);
+
+    std::vector<entry> entries_;
+    size_t count_;
+    bool young_keys_;               // some key was a young cons cell after minor collection 'minor_collections_'
+    size_t minor_collections_;
+};
+
+/* bytecode is a lambda body compiled for the VM, see compiler and vm_execute. "code" is a sequence of opcode_t, each
+ * followed by its operands, and "constants" holds the lisp values the operands refer to.
+ */
+struct bytecode {
+    std::vector<uint32_t> code;
+    std::vector<lisp_cell> constants;
+    size_t epoch;                       // proc_redefinitions when compiled
+    uint32_t running = 0;               // vm_execute calls running it
+};
+
+/* lambda_code is a "(lambda (params) body...)" form after resolve: the parameter list and the resolved body, the
+ * names of the slots of its call frames, the parameters first and then the local variables defined in the body, and the
+ * variables of enclosing lambdas its closures capture.
+ */
+class lambda_code: public lisp_object {
+    lisp_cell params_;
+    lisp_cell body_;
+    uint32_t nparams_;
+    bool unnamed_params_;
+    std::vector<symbol *> names_;       // slot -> name, nullptr for a parameter that is not a symbol
+    std::vector<uint8_t> flags_;        // slot -> CAPTURED | ASSIGNED
+    std::vector<uint32_t> boxed_;       // the slots that are captured and assigned, held in a lisp_box
+    std::vector<lisp_cell> captures_;   // captured variable -> the local variable it is where the closure is created
+    std::vector<symbol *> captured_names_;
+    bytecode *bytecode_;
+    std::vector<bytecode *> retired_;   // replaced by a recompile while running, freed when the last run is done
+
+    enum { CAPTURED = 1, ASSIGNED = 2 };
+    void set_flag(uint32_t slot, uint8_t flag)
+    {
+        if (flags_[slot] != (CAPTURED | ASSIGNED) && (flags_[slot] |= flag) == (CAPTURED | ASSIGNED))
+            boxed_.push_back(slot);
+    }
+
+public:
+    explicit lambda_code(lisp_cell params):
+        lisp_object(CODE), params_(params), body_(nullptr), nparams_(0), unnamed_params_(false), bytecode_(nullptr) {}
+    ~lambda_code()
+    {
+        delete bytecode_;
+        for (bytecode *bc: retired_)
+            delete bc;
+    }
+
+    lisp_cell params(void)              { return params_; }
+    lisp_cell body(void)                { return body_; }
+    void set_body(lisp_cell body);
+
+    uint32_t nparams(void) const        { return nparams_; }
+    uint32_t nslots(void) const         { return static_cast<uint32_t>(names_.size()); }
+    symbol *name(uint32_t slot) const   { return names_[slot]; }
+    const std::vector<symbol *> &names(void) const { return names_; }
+
+    // a closure of a nested lambda captures the slot, the body assigns it (setq, or the define of a local variable)
+    void set_captured(uint32_t slot)    { set_flag(slot, CAPTURED); }
+    void set_assigned(uint32_t slot)    { set_flag(slot, ASSIGNED); }
+    const std::vector<uint32_t> &boxed(void) const { return boxed_; }
+
+    uint32_t ncaptured(void) const      { return static_cast<uint32_t>(captures_.size()); }
+    lisp_cell capture(uint32_t i) const { return captures_[i]; }
+    symbol *captured_name(uint32_t i) const { return captured_names_[i]; }
+    // capture the local variable 'var' of the enclosing lambda, named 's'. Returns the index of the captured variable.
+    uint32_t add_capture(lisp_cell var, symbol *s)
+    {
+        auto iter = std::find(captures_.begin(), captures_.end(), var);
+        if (iter != captures_.end())
+            return static_cast<uint32_t>(iter - captures_.begin());
+        captures_.push_back(var);
+        captured_names_.push_back(s);
+        return ncaptured() - 1;
+    }
+
+    // the compiled body, or nullptr
+    bytecode *compiled(void) const      { return bytecode_; }
+    // replace the compiled body by 'bc'. The previous one is freed, or retired while a vm_execute is still running it.
+    void set_compiled(bytecode *bc)
+    {
+        if (bytecode_ != nullptr && bytecode_->running > 0)
+            retired_.push_back(bytecode_);
+        else
+            delete bytecode_;
+        bytecode_ = bc;
+    }
+    // a vm_execute call is done running 'bc', which is freed if it was the last run of a retired one
+    void release(bytecode *bc)
+    {
+        if (--bc->running == 0 && bc != bytecode_)
+        {
+            retired_.erase(std::find(retired_.begin(), retired_.end(), bc));
+            delete bc;
+        }
+    }
+
+    void add_param(symbol *s)
+    {
+        names_.push_back(s);
+        flags_.push_back(0);
+        nparams_++;
+        unnamed_params_ |= s == nullptr;
+    }
+    // a parameter is not a symbol: its argument is not evaluated, see eval_arguments
+    bool unnamed_params(void) const     { return unnamed_params_; }
+    void add_local(symbol *s)
+    {
+        if (std::find(names_.begin(), names_.end(), s) == names_.end())
+        {
+            names_.push_back(s);
+            flags_.push_back(0);
+        }
+    }
+
+    void trace(void) override;
+};
+
+/* lambda is a function definition, a flat closure: its code, the environment of its global variables, and a copy of
+ * the variables of the enclosing lambdas its body uses, stored right after the object. A captured variable that is
+ * assigned is copied as the lisp_box holding it. A closure never references the frame it was created in.
+ */
+class lambda: public lisp_object {
+    lambda_code *code_;
+    environment *env_;
+    uint32_t ncaptured_;
+
+public:
+    // allocate with new (code->ncaptured()) lambda(code, env), 'env' is the environment (or frame) it is created in
+    lambda(lambda_code *code, environment *env);
+
+    using lisp_object::operator new;
+    using lisp_object::operator delete;
+    static void *operator new(size_t size, uint32_t ncaptured)
+    {
+        return lisp_object::operator new(size + ncaptured * sizeof(lisp_cell));
+    }
+    static void operator delete(void *p, uint32_t)
+    {
+        lisp_object::operator delete(p);
+    }
+
+    lambda_code *code(void)             { return code_; }
+    lisp_cell params(void)              { return code_->params(); }
+    lisp_cell body(void)                { return code_->body(); }
+
+    environment *env(void)              { return env_; }
+    lisp_cell *captured(void)           { return reinterpret_cast<lisp_cell *>(this + 1); }
+
+    void trace(void) override;
+};
+
+/* lisp_box holds a variable that a closure captures and that is assigned, so that its frame and every closure capturing
+ * it share it. It is never the value of an expression.
+ */
+class lisp_box: public lisp_object {
+    lisp_cell value_;
+
+public:
+    explicit lisp_box(lisp_cell value): lisp_object(BOX), value_(value) {}
+
+    lisp_cell value(void) const         { return value_; }
+    void set(lisp_cell value)
+    {
+        value_ = value;
+        gc.write_barrier(this, value);
+    }
+
+    void trace(void) override           { gc.mark(value_); }
+};
+
+/* global_ref is the head of a call of a global function in a resolved lambda body, such as 'fib' in "(fib (- n 1))",
+ * with an inline cache of the value cell the symbol was found in: the first lookup of the call site stores the cell and
+ * the environment the lookup started from, and the next ones read the cell directly. The cache is valid until a symbol
+ * is bound in a scope that may shadow it, see binding_epoch. Assigning the variable updates the cell itself, which the
+ * cache keeps seeing. The cached environment and cell are not references for the garbage collector.
+ */
+class global_ref: public lisp_object {
+    symbol *sym_;
+    environment *env_;
+    lisp_cell *cell_;
+    size_t epoch_;
+
+public:
+    explicit global_ref(symbol *s): lisp_object(GLOBAL), sym_(s), env_(nullptr), cell_(nullptr), epoch_(0) {}
+
+    symbol *sym(void) const             { return sym_; }
+
+    // the cell cached for a lookup from 'env', or nullptr
+    lisp_cell *cached(const environment *env) const
+    {
+        return env == env_ && epoch_ == binding_epoch ? cell_ : nullptr;
+    }
+    void cache(environment *env, lisp_cell *cell)
+    {
+        env_ = env;
+        cell_ = cell;
+        epoch_ = binding_epoch;
+    }
+};
+
+size_t garbage_collector::size_class(size_t size)
+{
+    size_t cls = 0;
+    while (class_sizes_[cls] < size)
+        cls++;
+    return cls;
+}
+
+void garbage_collector::add_page(size_t cls)
+{
+    page *p = static_cast<page *>(aligned_alloc(PAGE_SIZE, PAGE_SIZE));
+    if (p == nullptr)
+        throw std::bad_alloc();
+    memset(p, 0, page::header_size());
+    p->slot_size = class_sizes_[cls];
+    p->nslots = static_cast<uint32_t>((PAGE_SIZE - page::header_size()) / p->slot_size);
+    pages_[cls].push_back(p);
+
+    for (size_t i = p->nslots; i-- > 0; )
+    {
+        void *slot = p->slot(i);
+        *static_cast<void **>(slot) = free_[cls];
+        free_[cls] = slot;
+    }
+}
+
+void *garbage_collector::allocate_slot(size_t cls)
+{
+    if (free_[cls] == nullptr)
+        add_page(cls);
+    void *slot = free_[cls];
+    free_[cls] = *static_cast<void **>(slot);
+
+    page *p = page_of(slot);
+    page::set(p->allocated, p->index(slot));
+    return slot;
+}
+
+inline lisp_cells *garbage_collector::allocate_cons(lisp_cell car, lisp_cell cdr)
+{
+    if (top_ == end_)
+    {
+        gc_root root(car, cdr);
+        minor_collect();
+        if (should_collect(0))
+            collect();
+    }
+    lisp_cells *cells = reinterpret_cast<lisp_cells *>(top_);
+    top_ += sizeof(lisp_cells);
+    return new (cells) lisp_cells(car, cdr);
+}
+
+lisp_cells *garbage_collector::allocate_old_cons(lisp_cell car, lisp_cell cdr)
+{
+    if (should_collect(sizeof(lisp_cells)))
+    {
+        gc_root root(car, cdr);
+        collect();
+    }
+    lisp_cells *cells = new (allocate_slot(0)) lisp_cells(car, cdr);
+    write_barrier(cells, car);
+    write_barrier(cells, cdr);
+    return cells;
+}
+
+void *garbage_collector::allocate(size_t size)
+{
+    if (should_collect(size))
+        collect();
+    void *p;
+    if (size > MAX_SMALL)
+    {
+        p = malloc(size);
+        if (p == nullptr)
+            throw std::bad_alloc();
+        large_.push_back({static_cast<lisp_object *>(p), size});
+    }
+    else
+        p = allocate_slot(size_class(size));
+    new_objects_.push_back(static_cast<lisp_object *>(p));
+    return p;
+}
+
+// only called when the constructor of a new object throws
+void garbage_collector::release(void *p)
+{
+    new_objects_.erase(std::find(new_objects_.begin(), new_objects_.end(), static_cast<lisp_object *>(p)));
+
+    auto iter = std::find_if(large_.begin(), large_.end(),
+                             [p](const large_object &large) { return large.object == p; });
+    if (iter != large_.end())
+    {
+        large_.erase(iter);
+        free(p);
+        return;
+    }
+    page *pg = page_of(p);
+    size_t cls = size_class(pg->slot_size);
+    page::clear(pg->allocated, pg->index(p));
+    *static_cast<void **>(p) = free_[cls];
+    free_[cls] = p;
+}
+
+void *garbage_collector::allocate_frame(size_t size)
+{
+    if (size > static_cast<size_t>(frame_end_ - frame_top_))
+    {
+        // continue in the next chunk, replacing it if it is too small
+        frame_chunk_++;
+        if (frame_chunk_ == frame_chunks_.size())
+            frame_chunks_.push_back(add_frame_chunk(size > FRAME_CHUNK ? size : size_t(FRAME_CHUNK)));
+        else if (frame_chunks_[frame_chunk_].size < size)
+        {
+            free(frame_chunks_[frame_chunk_].base);
+            frame_chunks_[frame_chunk_] = add_frame_chunk(size);
+        }
+        frame_top_ = frame_chunks_[frame_chunk_].base;
+        frame_end_ = frame_top_ + frame_chunks_[frame_chunk_].size;
+    }
+    void *p = frame_top_;
+    frame_top_ += size;
+    return p;
+}
+
+void garbage_collector::push_frame(lisp_object *frame)
+{
+    frame->remembered = true;
+    frames_.push_back(frame);
+}
+
+void garbage_collector::pop_frame(void)
+{
+    lisp_object *frame = frames_.back();
+    frames_.pop_back();
+    frame->~lisp_object();
+
+    // the frame was the first one in the current chunk, go back to the previous chunk
+    char *p = reinterpret_cast<char *>(frame);
+    if (p < frame_chunks_[frame_chunk_].base || p >= frame_end_)
+    {
+        frame_chunk_--;
+        frame_end_ = frame_chunks_[frame_chunk_].base + frame_chunks_[frame_chunk_].size;
+    }
+    frame_top_ = p;
+}
+
+void garbage_collector::remember(lisp_object *object)
+{
+    if (!object->remembered)
+    {
+        object->remembered = true;
+        remembered_objects_.push_back(object);
+    }
+}
+
+inline void garbage_collector::write_barrier(lisp_object *object, lisp_cell value)
+{
+    if (is_young(value))
+        remember(object);
+}
+
+// a young cell is overwritten by its forwarding address when it is promoted
+const lisp_cell forwarded_sexpr = lisp_cell::immediate(0xFFFFFF);
+
+void garbage_collector::promote(lisp_cell &cell)
+{
+    lisp_cells *young = cell.cells();
+    if (young->car() == forwarded_sexpr)
+    {
+        cell = young->cdr();
+        return;
+    }
+    lisp_cells *old = new (allocate_slot(0)) lisp_cells(young->car(), young->cdr());
+    allocated_ += sizeof(lisp_cells);
+    young->car_ref() = forwarded_sexpr;
+    young->cdr_ref() = lisp_cell(old);
+    cell = lisp_cell(old);
+    mark_cells_.push_back(old);
+}
+
+void garbage_collector::minor_collect(void)
+{
+    minor_ = true;
+    collecting_ = true;
+
+    for (lisp_cell *cell: cell_roots_)
+        mark(*cell);
+    for (lisp_cell &cell: arguments_)
+        mark(cell);
+    for (lisp_object *object: new_objects_)
+        object->trace();
+    for (lisp_object *frame: frames_)
+        frame->trace();
+    for (lisp_object *object: remembered_objects_)
+    {
+        object->trace();
+        object->remembered = false;
+    }
+    for (lisp_cells *cells: remembered_cells_)
+    {
+        mark(cells->car_ref());
+        mark(cells->cdr_ref());
+    }
+    // scan the promoted cells, Cheney style
+    while (!mark_cells_.empty())
+    {
+        lisp_cells *cells = mark_cells_.back();
+        mark_cells_.pop_back();
+        mark(cells->car_ref());
+        mark(cells->cdr_ref());
+    }
+
+    new_objects_.clear();
+    remembered_objects_.clear();
+    remembered_cells_.clear();
+    total_allocated_ += top_ - nursery_;
+    top_ = nursery_;
+    minor_collections_++;
+    minor_ = false;
+    collecting_ = false;
+}
+
+void garbage_collector::mark(lisp_cell &cell)
+{
+    if (cell.isLispCells())
+    {
+        lisp_cells *c = cell.cells();
+        if (minor_)
+        {
+            if (is_young(c))
+                promote(cell);
+            return;
+        }
+        page *p = page_of(c);
+        size_t i = p->index(c);
+        if (!page::test(p->marked, i))
+        {
+            page::set(p->marked, i);
+            mark_cells_.push_back(c);
+        }
+    }
+    else if (minor_)
+        return;
+    else if (cell.isSymbol())
+        mark(static_cast<lisp_object *>(cell.sym()));
+    else if (cell.isObject())
+        mark(cell.object());
+}
+
+void garbage_collector::mark(lisp_object *object)
+{
+    if (object != nullptr && !minor_ && object->marked != epoch_)
+    {
+        object->marked = epoch_;
+        mark_objects_.push_back(object);
+    }
+}
+
+void garbage_collector::drain(void)
+{
+    while (!mark_cells_.empty() || !mark_objects_.empty())
+    {
+        if (!mark_cells_.empty())
+        {
+            lisp_cells *c = mark_cells_.back();
+            mark_cells_.pop_back();
+            mark(c->car_ref());
+            mark(c->cdr_ref());
+        }
+        else
+        {
+            lisp_object *object = mark_objects_.back();
+            mark_objects_.pop_back();
+            object->trace();
+        }
+    }
+}
+
+/* end of a top-level form (arena_mode): what the form left reachable, from the global environment or the roots, is
+ * evacuated into the old generation and the nursery is freed in bulk. The next form starts with an empty nursery, so
+ * the temporaries of a form that allocates less than NURSERY_SIZE are never copied, and never end up as old garbage
+ * that only a major collection can free.
+ */
+void garbage_collector::end_form(void)
+{
+    if (top_ != nursery_)
+        minor_collect();
+    if (should_collect(0))
+        collect();
+}
+
+// a major collection: empty the nursery, then mark and sweep the old generation
+void garbage_collector::collect(void)
+{
+    minor_collect();
+
+    collecting_ = true;
+    epoch_ = !epoch_;
+    for (auto &pages: pages_)
+        for (page *p: pages)
+            memset(p->marked, 0, sizeof p->marked);
+
+    for (lisp_object *object: roots_)
+        mark(object);
+    for (auto &entry: symbol_table())
+        mark(static_cast<lisp_object *>(entry.second));
+    for (lisp_cell *cell: cell_roots_)
+        mark(*cell);
+    for (lisp_cell &cell: arguments_)
+        mark(cell);
+    for (auto &root: object_roots_)
+        mark(root.get(root.address));
+    for (lisp_object *frame: frames_)
+        frame->trace();
+    drain();
+
+    sweep();
+    collections_++;
+    allocated_ = 0;
+    threshold_ = live_ > MIN_THRESHOLD ? live_ : size_t(MIN_THRESHOLD);
+    collecting_ = false;
+}
+
+void garbage_collector::sweep(void)
+{
+    live_ = 0;
+    for (size_t cls = 0; cls < NCLASSES; cls++)
+    {
+        free_[cls] = nullptr;
+        auto &pages = pages_[cls];
+        for (size_t n = 0; n < pages.size(); )
+        {
+            page *p = pages[n];
+            size_t nlive = 0;
+            for (size_t i = 0; i < p->nslots; i++)
+            {
+                if (!page::test(p->allocated, i))
+                    continue;
+                bool live = cls == 0 ? page::test(p->marked, i)
+                                     : reinterpret_cast<lisp_object *>(p->slot(i))->marked == epoch_;
+                if (live)
+                    nlive++;
+                else
+                {
+                    if (cls != 0)
+                        reinterpret_cast<lisp_object *>(p->slot(i))->~lisp_object();
+                    page::clear(p->allocated, i);
+                }
+            }
+            // give empty pages back
+            if (nlive == 0)
+            {
+                free(p);
+                pages[n] = pages.back();
+                pages.pop_back();
+                continue;
+            }
+            for (size_t i = p->nslots; i-- > 0; )
+                if (!page::test(p->allocated, i))
+                {
+                    *reinterpret_cast<void **>(p->slot(i)) = free_[cls];
+                    free_[cls] = p->slot(i);
+                }
+            live_ += nlive * p->slot_size;
+            n++;
+        }
+    }
+
+    for (size_t n = 0; n < large_.size(); )
+    {
+        lisp_object *object = large_[n].object;
+        if (object->marked == epoch_)
+        {
+            live_ += large_[n].size;
+            n++;
+            continue;
+        }
+        object->~lisp_object();
+        free(object);
+        large_[n] = large_.back();
+        large_.pop_back();
+    }
+}
+
+// destroy the objects still alive, which may own memory of their own, and give back the heap
+garbage_collector::~garbage_collector()
+{
+    for (size_t cls = 1; cls < NCLASSES; cls++)
+        for (page *p: pages_[cls])
+            for (size_t i = 0; i < p->nslots; i++)
+                if (page::test(p->allocated, i))
+                    reinterpret_cast<lisp_object *>(p->slot(i))->~lisp_object();
+    for (auto &pages: pages_)
+        for (page *p: pages)
+            free(p);
+    for (auto &large: large_)
+    {
+        large.object->~lisp_object();
+        free(large.object);
+    }
+    free(nursery_);
+    for (auto &chunk: frame_chunks_)
+        free(chunk.base);
+}
+
+inline void *lisp_object::operator new(size_t size)
+{
+    return gc.allocate(size);
+}
+
+inline void lisp_object::operator delete(void *p)
+{
+    gc.release(p);
+}
+
+
+inline lisp_cell::lisp_cell(lisp_cell car, lisp_cell cdr):
+    bits_(reinterpret_cast<uint64_t>(gc.allocate_cons(car, cdr)) | TAG_CONS) {}
+
+inline lisp_cell::lisp_cell(lisp_int_t n)
+{
+    if (fitsFixnum(n))
+        bits_ = FIXNUM_TAG | (static_cast<uint64_t>(n) & FIXNUM_MASK);
+    else
+        bits_ = reinterpret_cast<uint64_t>(new lisp_integer(bigint(n))) | TAG_OBJECT;
+}
+
+// a fixnum if it fits, otherwise boxed
+inline lisp_cell::lisp_cell(const bigint &b)
+{
+    lisp_int_t n;
+    if (b.get(n))
+        *this = lisp_cell(n);
+    else
+        bits_ = reinterpret_cast<uint64_t>(new lisp_integer(b)) | TAG_OBJECT;
+}
+
+inline lisp_cell::lisp_cell(double d)
+{
+    uint64_t raw;
+    if (d != d)
+        raw = 0x7FF8000000000000ull;    // canonical quiet NaN
+    else
+        memcpy(&raw, &d, sizeof raw);
+    bits_ = raw + DOUBLE_OFFSET;
+}
+
+inline lisp_cell::lisp_cell(std::string_view s):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(new lisp_string(s))) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(proc_type p):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(new lisp_proc(p))) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(lisp_proc *p):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(p)) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(lambda *l):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(l)) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(lambda_code *c):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(c)) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(lisp_vector *v):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(v)) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(lisp_hash_table *h):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(h)) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(lisp_box *b):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(b)) | TAG_OBJECT) {}
+
+inline lisp_cell::lisp_cell(global_ref *g):
+    bits_(reinterpret_cast<uint64_t>(static_cast<lisp_object *>(g)) | TAG_OBJECT) {}
+
+inline bool lisp_cell::isObject(int kind) const
+{
+    return isObject() && object()->kind == kind;
+}
+
+// numbers, "quoted strings" and vectors evaluate to themselves
+inline bool lisp_cell::isConstant(void) const
+{
+    return isFixnum() || isDouble() || isObject(lisp_object::STRING) || isObject(lisp_object::INTEGER) ||
+        isObject(lisp_object::VECTOR);
+}
+
+inline lisp_cell lisp_cell::car(void) const
+{
+    if (isLispCells())
+        return cells()->car();
+    return nullptr;
+}
+
+inline lisp_cell lisp_cell::cdr(void) const
+{
+    if (isLispCells())
+        return cells()->cdr();
+    return nullptr;
+}
+
+inline void lisp_cell::set_car(lisp_cell value) const
+{
+    cells()->car_ref() = value;
+    gc.write_barrier(cells(), value);
+}
+
+inline void lisp_cell::set_cdr(lisp_cell value) const
+{
+    cells()->cdr_ref() = value;
+    gc.write_barrier(cells(), value);
+}
+
+template <>
+inline bool lisp_cell::getValue<lisp_int_t>(lisp_int_t &value) const
+{
+    if (isFixnum())
+        value = fixnum();
+    else if (isObject(lisp_object::INTEGER))
+        return static_cast<lisp_integer *>(object())->value().get(value);
+    else
+        return false;
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<double>(double &value) const
+{
+    if (!isDouble())
+        return false;
+    value = flonum();
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<const char *>(const char * &value) const
+{
+    if (!isObject(lisp_object::STRING))
+        return false;
+    value = static_cast<lisp_string *>(object())->text();
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<proc_type>(proc_type &value) const
+{
+    if (!isObject(lisp_object::PROC))
+        return false;
+    value = static_cast<lisp_proc *>(object())->func();
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<lambda *>(lambda * &value) const
+{
+    if (!isObject(lisp_object::LAMBDA))
+        return false;
+    value = static_cast<lambda *>(object());
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<symbol *>(symbol * &value) const
+{
+    if (!isSymbol())
+        return false;
+    value = sym();
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<lisp_vector *>(lisp_vector * &value) const
+{
+    if (!isObject(lisp_object::VECTOR))
+        return false;
+    value = static_cast<lisp_vector *>(object());
+    return true;
+}
+
+template <>
+inline bool lisp_cell::getValue<lisp_hash_table *>(lisp_hash_table * &value) const
+{
+    if (!isObject(lisp_object::HASH_TABLE))
+        return false;
+    value = static_cast<lisp_hash_table *>(object());
+    return true;
+}
+
+inline bool lisp_cell::isLambda(lambda* &l) const
+{
+    return getValue<lambda *>(l);
+}
+
+inline bool lisp_cell::isSymbol(symbol* &s) const
+{
+    return getValue<symbol *>(s);
+}
+
+inline bool lisp_cell::isVector(lisp_vector* &v) const
+{
+    return getValue<lisp_vector *>(v);
+}
+
+// the value of a local variable whose define has not run yet
+const lisp_cell unbound_sexpr = lisp_cell::immediate(0xFFFFFE);
+
+// report a reference to an undefined symbol
+void undefined_symbol(symbol *s)
+{
+    if (std::find(undefined_symbols.begin(), undefined_symbols.end(), s) == undefined_symbols.end())
+    {
+        // an undefined symbol may be referenced many times in one expression.
+        // Using undefined_symbols eliminates multiple error messages.
+        std::cout << "Undefined symbol '" << s->name() << "'" << std::endl;
+        undefined_symbols.push_back(s);
+    }
+}
+
+/* sym_map is the symbol table of an environment, from symbol id to value cell, with open addressing: a single array of
+ * entries, probed linearly. Symbols are never removed. Symbol ids are consecutive indexes, which the Fibonacci hash
+ * spreads evenly over the table, and the table is grown to stay at most half full, so that a lookup is one probe in the
+ * common case, even in a global environment of thousands of definitions. An empty table allocates nothing and a lookup
+ * in it reads no memory but the size, which is the case of every frame.
+ */
+class sym_map {
+public:
+    sym_map(): count_(0), shift_(64) {}
+
+    bool empty(void) const              { return count_ == 0; }
+    size_t size(void) const             { return count_; }
+
+    // the value cell of the symbol 'id', or nullptr
+    lisp_cell *find(symbol_id id) const
+    {
+        if (count_ == 0)
+            return nullptr;
+        return entries_[lookup(id)].cell;
+    }
+
+    // add the symbol 'id', which is not in the table yet
+    void insert(symbol_id id, lisp_cell *cell)
+    {
+        if (2 * (count_ + 1) > entries_.size())
+            resize(entries_.empty() ? MIN_CAPACITY : 2 * entries_.size());
+        entries_[lookup(id)] = entry{id, cell};
+        count_++;
+    }
+
+private:
+    static const size_t MIN_CAPACITY = 8;
+
+    struct entry {
+        symbol_id id;
+        lisp_cell *cell;            // nullptr for a free entry
+    };
+
+    // the entry of the symbol 'id', or the free entry where it belongs
+    size_t lookup(symbol_id id) const
+    {
+        size_t mask = entries_.size() - 1;
+        for (size_t i = (id * 0x9E3779B97F4A7C15ull) >> shift_; ; i = (i + 1) & mask)
+        {
+            const entry &e = entries_[i];
+            if (e.cell == nullptr || e.id == id)
+                return i;
+        }
+    }
+
+    void resize(size_t capacity)
+    {
+        std::vector<entry> old(capacity, entry{0, nullptr});
+        old.swap(entries_);
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c >>= 1)
+            shift_--;
+        for (const entry &e: old)
+            if (e.cell != nullptr)
+                entries_[lookup(e.id)] = e;
+    }
+
+    std::vector<entry> entries_;
+    size_t count_;
+    unsigned shift_;                // 64 - log2 of the capacity, the hash is the top bits of the product
+};
+
+// Environment is a dictionary that associates symbols with lisp_cells (symbol table), and chain to an "outer" dictionary.
+// The dictionary is a sym_map from the symbol to its value cell. A value cell keeps its address for the life of the
+// environment, so that a global_ref can cache it.
+//
+// The environment of a lambda call is a frame instead: a flat array of slots, one per parameter and local variable of
+// the lambda_code, stored right after the object, and the closure being called, which holds the captured variables. The
+// resolved body reaches both by index, see resolve. The outer environment of a frame is the one of its closure.
+class environment: public lisp_object {
+public:
+    environment(environment *outer = 0) :
+        lisp_object(ENVIRONMENT), outer_(outer), code_(nullptr), closure_(nullptr), nslots_(0) {}
+
+    // a frame of a call of 'closure', see push_frame
+    explicit environment(lambda *closure) :
+        lisp_object(ENVIRONMENT), outer_(closure->env()), code_(closure->code()), closure_(closure),
+        nslots_(code_->nslots())
+    {
+        for (uint32_t i = 0; i < nslots_; i++)
+            slots()[i] = unbound_sexpr;
+    }
+
+    using lisp_object::operator new;
+    using lisp_object::operator delete;
+    static void *operator new(size_t size, uint32_t nslots)
+    {
+        return lisp_object::operator new(size + nslots * sizeof(lisp_cell));
+    }
+    static void operator delete(void *p, uint32_t)
+    {
+        lisp_object::operator delete(p);
+    }
+    static void *operator new(size_t, void *p)      { return p; }
+    static void operator delete(void *, void *)     {}
+
+    // the cells a global_ref may have cached go away
+    ~environment()
+    {
+        if (code_ == nullptr || !env_.empty())
+            binding_epoch++;
+    }
+
+    // a frame on the frame stack, pop it with gc.pop_frame()
+    static environment *push_frame(lambda *closure)
+    {
+        void *p = gc.allocate_frame(sizeof(environment) + closure->code()->nslots() * sizeof(lisp_cell));
+        environment *frame = new (p) environment(closure);
+        gc.push_frame(frame);
+        return frame;
+    }
+
+    // bind the evaluated arguments 'values' to the parameter slots of the frame, see eval_arguments, and put the
+    // variables that are captured and assigned in boxes
+    void bind(const lisp_cell *values)
+    {
+        uint32_t nparams = code_->nparams();
+        for (uint32_t i = 0; i < nparams; i++)
+            set_slot(i, values[i]);
+    }
+    void box(void)
+    {
+        for (uint32_t slot: code_->boxed())
+        {
+            lisp_box *b = new lisp_box(slots()[slot]);
+            set_slot(slot, lisp_cell(b));
+        }
+    }
+
+    // Symbol lookup. Check the outer env if not found in current one
+    bool FindSymbol(symbol *s, lisp_cell &cell)
+    {
+        if (LookupSymbol(s, cell))
+            return true;
+        undefined_symbol(s);
+        return false;
+    }
+
+    // FindSymbol without the error message
+    bool LookupSymbol(symbol *s, lisp_cell &cell)
+    {
+        lisp_cell *p = FindCell(s);
+        if (p == nullptr)
+            return false;
+        cell = *p;
+        return true;
+    }
+
+    // the value cell of the symbol 's' in this environment or an outer one, or nullptr
+    lisp_cell *FindCell(symbol *s)
+    {
+        for (environment *env = this; env != nullptr; env = env->outer_)
+        {
+            lisp_cell *cell = env->env_.find(s->id());
+            if (cell != nullptr)
+                return cell;
+        }
+        return nullptr;
+    }
+
+    // Symbol lookup of the head of a call, through the cache of 'ref'
+    bool FindGlobal(global_ref *ref, lisp_cell &cell)
+    {
+        // a frame without symbols of its own, as they all are, looks up from the environment of its closure
+        environment *env = code_ != nullptr && env_.empty() ? outer_ : this;
+        lisp_cell *p = ref->cached(env);
+        if (p == nullptr)
+        {
+            p = env->FindCell(ref->sym());
+            if (p == nullptr)
+            {
+                undefined_symbol(ref->sym());
+                return false;
+            }
+            ref->cache(env, p);
+        }
+        cell = *p;
+        return true;
+    }
+
+    // Local variable lookup, 'ref' is a lisp_cell::local. Fails if the variable is not defined yet.
+    bool FindLocal(lisp_cell ref, lisp_cell &cell)
+    {
+        cell = variable(ref);
+        if (cell.isObject(BOX))
+            cell = static_cast<lisp_box *>(cell.object())->value();
+        if (cell != unbound_sexpr)
+            return true;
+        undefined_symbol(LocalName(ref));
+        return false;
+    }
+
+    // the name of a local variable, 'ref' is a lisp_cell::local
+    symbol *LocalName(lisp_cell ref)
+    {
+        return ref.captured() ? code_->captured_name(ref.slot()) : code_->name(ref.slot());
+    }
+
+    // the local variable 'ref' as stored in the frame or the closure: its value, or the lisp_box holding it
+    lisp_cell &variable(lisp_cell ref)
+    {
+        return ref.captured() ? closure_->captured()[ref.slot()] : slots()[ref.slot()];
+    }
+
+    // Update a symbol definition. "current_scope_only" is to disambiguate between "define" and "setq".
+    // define always updates in current scope (and creates the symbol if needed), and setq will only
+    // update if the symbol already exists (i.e. created by using define.
+    bool UpdateSymbol(symbol *s, lisp_cell cell, bool current_scope_only)
+    {
+        bool result = true;
+        lisp_cell *var = env_.find(s->id());
+
+        // symbol exists, just update its value
+        if (var != nullptr)
+        {
+            if (var->isObject(PROC))
+                proc_redefinitions++;
+            *var = cell;
+        }
+        // define, always update/add in current scope
+        else if (current_scope_only)
+            *add_cell(s->id()) = cell;
+        // set! only add if symbol exists in some scope
+        else if (outer_)
+            return outer_->UpdateSymbol(s, cell, false);
+        else
+            result = false;
+        if (result)
+            gc.write_barrier(this, cell);
+        return result;
+    }
+
+    // Update a local variable, 'ref' is a lisp_cell::local. Like UpdateSymbol, setq fails if the variable is not
+    // defined yet.
+    bool UpdateLocal(lisp_cell ref, lisp_cell cell, bool is_define)
+    {
+        lisp_cell &var = variable(ref);
+        if (var.isObject(BOX))
+        {
+            lisp_box *b = static_cast<lisp_box *>(var.object());
+            if (!is_define && b->value() == unbound_sexpr)
+                return false;
+            b->set(cell);
+            return true;
+        }
+        if (!is_define && var == unbound_sexpr)
+            return false;
+        // a captured variable is only assigned here if it is not boxed, by a lambda made at run time
+        var = cell;
+        gc.write_barrier(ref.captured() ? static_cast<lisp_object *>(closure_) : this, cell);
+        return true;
+    }
+
+    // return a reference to the cell associated with the given symbol 'var' in current environment. The caller may
+    // store a young cell through it, so the environment is remembered by the write barrier.
+    lisp_cell &operator[] (const std::string& var)
+    {
+        gc.remember(this);
+        symbol_id id = intern(var)->id();
+        lisp_cell *cell = env_.find(id);
+        return *(cell != nullptr ? cell : add_cell(id));
+    }
+
+    environment *outer(void)            { return outer_; }
+    lambda_code *code(void)             { return code_; }
+    lambda *closure(void)               { return closure_; }
+
+    void trace(void) override
+    {
+        for (lisp_cell &cell: cells_)
+            gc.mark(cell);
+        gc.mark(outer_);
+        gc.mark(code_);
+        gc.mark(closure_);
+        for (uint32_t i = 0; i < nslots_; i++)
+            gc.mark(slots()[i]);
+    }
+
+private:
+    lisp_cell *slots(void)              { return reinterpret_cast<lisp_cell *>(this + 1); }
+    void set_slot(uint32_t i, lisp_cell cell)
+    {
+        slots()[i] = cell;
+        gc.write_barrier(this, cell);
+    }
+
+    // a new value cell for the symbol 'id'. Unless this is the outermost environment, the symbol may now be shadowed
+    lisp_cell *add_cell(symbol_id id)
+    {
+        cells_.emplace_front();
+        env_.insert(id, &cells_.front());
+        if (outer_ != nullptr)
+            binding_epoch++;
+        return &cells_.front();
+    }
+
+    sym_map env_;           // inner symbol->cell mapping
+    std::forward_list<lisp_cell> cells_;    // the value cells of env_
+    environment *outer_;    // next adjacent outer env, or 0 if there are no further environments
+    lambda_code *code_;     // for a frame, the code it is a call of
+    lambda *closure_;       // for a frame, the closure it is a call of
+    uint32_t nslots_;       // for a frame, the number of slots
+};
+
+// a closure made in 'env' uses the global variables of 'env', and the variables of the frame 'env' it captures
+lambda::lambda(lambda_code *code, environment *env) :
+    lisp_object(LAMBDA), code_(code), env_(env->code() != nullptr ? env->outer() : env), ncaptured_(code->ncaptured())
+{
+    for (uint32_t i = 0; i < ncaptured_; i++)
+        captured()[i] = env->variable(code->capture(i));
+}
+
+void lambda_code::set_body(lisp_cell body)
+{
+    body_ = body;
+    gc.write_barrier(this, body);
+}
+
+void lambda_code::trace(void)
+{
+    gc.mark(params_);
+    gc.mark(body_);
+    if (bytecode_ != nullptr)
+        for (lisp_cell &cell: bytecode_->constants)
+            gc.mark(cell);
+    for (bytecode *bc: retired_)
+        for (lisp_cell &cell: bc->constants)
+            gc.mark(cell);
+}
+
+void lambda::trace(void)
+{
+    gc.mark(code_);
+    gc.mark(env_);
+    for (uint32_t i = 0; i < ncaptured_; i++)
+        gc.mark(captured()[i]);
+}
+
+const lisp_cell false_sexpr = lisp_cell::immediate(0);
+const lisp_cell true_sexpr  = lisp_cell::immediate(1);
+const lisp_cell nil_sexpr   = lisp_cell::immediate(2);
+const lisp_cell bad_sexpr   = lisp_cell::immediate(3);
+
+// printed names of the immediates, indexed by immediate number
+const char *immediate_names[] = { "#f", "#t", "#nil", "#error" };
+
+inline lisp_vector::lisp_vector(size_t size): lisp_object(VECTOR), size_(size)
+{
+    for (size_t i = 0; i < size_; i++)
+        elements()[i] = nil_sexpr;
+}
+
+lisp_hash_table::lisp_hash_table(size_t size):
+    lisp_object(HASH_TABLE), count_(0), young_keys_(false), minor_collections_(0)
+{
+    size_t capacity = 8;
+    while (capacity / 4 * 3 < size && capacity < entries_.max_size() / 2)
+        capacity *= 2;
+    entries_.assign(capacity, entry{0, unbound_sexpr, unbound_sexpr});
+}
+
+uint64_t lisp_hash_table::hash(lisp_cell key)
+{
+    uint64_t h;
+    const char *s;
+    if (key.getValue<const char *>(s))
+    {
+        // FNV-1a
+        h = 14695981039346656037ull;
+        for (; *s != 0; s++)
+            h = (h ^ static_cast<uint8_t>(*s)) * 1099511628211ull;
+    }
+    else if (key.isObject(lisp_object::INTEGER))
+        h = static_cast<lisp_integer *>(key.object())->value().hash();
+    else
+        h = key.bits();
+
+    // mix all the bits into the low ones, which pick the slot: pointers are aligned and fixnums small
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+bool lisp_hash_table::equal(lisp_cell a, lisp_cell b)
+{
+    if (a == b)
+        return true;
+    const char *s1, *s2;
+    if (a.getValue<const char *>(s1) && b.getValue<const char *>(s2))
+        return strcmp(s1, s2) == 0;
+    if (a.isObject(lisp_object::INTEGER) && b.isObject(lisp_object::INTEGER))
+        return static_cast<lisp_integer *>(a.object())->value().compare(static_cast<lisp_integer *>(b.object())->value()) == 0;
+    return false;
+}
+
+// the index of the entry of 'key', or of the free entry where it would go
+size_t lisp_hash_table::lookup(lisp_cell key, uint64_t h) const
+{
+    size_t mask = entries_.size() - 1;
+    for (size_t i = h & mask; ; i = (i + 1) & mask)
+    {
+        const entry &e = entries_[i];
+        if (e.key == unbound_sexpr || (e.hash == h && equal(e.key, key)))
+            return i;
+    }
+}
+
+// reinsert every entry into 'capacity' entries, hashing the keys again
+void lisp_hash_table::resize(size_t capacity)
+{
+    std::vector<entry> old(capacity, entry{0, unbound_sexpr, unbound_sexpr});
+    old.swap(entries_);
+    young_keys_ = false;
+    for (auto &e: old)
+        if (e.key != unbound_sexpr)
+        {
+            uint64_t h = hash(e.key);
+            entries_[lookup(e.key, h)] = entry{h, e.key, e.value};
+            note_young(e.key);
+        }
+}
+
+void lisp_hash_table::note_young(lisp_cell key)
+{
+    if (gc.is_young(key))
+    {
+        young_keys_ = true;
+        minor_collections_ = gc.minor_collections();
+    }
+}
+
+// rehash if a minor collection may have moved a key
+void lisp_hash_table::rehash_moved(void)
+{
+    if (young_keys_ && minor_collections_ != gc.minor_collections())
+        resize(entries_.size());
+}
+
+bool lisp_hash_table::find(lisp_cell key, lisp_cell &value)
+{
+    rehash_moved();
+    const entry &e = entries_[lookup(key, hash(key))];
+    if (e.key == unbound_sexpr)
+        return false;
+    value = e.value;
+    return true;
+}
+
+void lisp_hash_table::insert(lisp_cell key, lisp_cell value)
+{
+    rehash_moved();
+    if ((count_ + 1) * 4 > entries_.size() * 3)
+        resize(entries_.size() * 2);
+
+    uint64_t h = hash(key);
+    entry &e = entries_[lookup(key, h)];
+    if (e.key == unbound_sexpr)
+    {
+        e.hash = h;
+        e.key = key;
+        count_++;
+        note_young(key);
+        gc.write_barrier(this, key);
+    }
+    e.value = value;
+    gc.write_barrier(this, value);
+}
+
+bool lisp_hash_table::remove(lisp_cell key)
+{
+    rehash_moved();
+    size_t mask = entries_.size() - 1;
+    size_t i = lookup(key, hash(key));
+    if (entries_[i].key == unbound_sexpr)
+        return false;
+
+    // move back the entries after the hole that may fill it: those whose home entry is not after the hole
+    for (size_t j = (i + 1) & mask; entries_[j].key != unbound_sexpr; j = (j + 1) & mask)
+        if (((j - entries_[j].hash) & mask) >= ((j - i) & mask))
+        {
+            entries_[i] = entries_[j];
+            i = j;
+        }
+    entries_[i] = entry{0, unbound_sexpr, unbound_sexpr};
+    count_--;
+    return true;
+}
+
+// Primitive Operations
+bool hasTwoOperands(lisp_cell sexpr)
+{
+    if (sexpr == nullptr || sexpr.car() == nullptr || sexpr.cdr() == nullptr)
+        return false;
+    return true;
+}
+
+// Arithmetic Primitives
+//
+// binop primitives (+-*/) can have a list of operands, e.g. (+ 1 2 3 4). The operands are walked once, left to right,
+// each evaluated exactly once, and folded from the left: (- 10 3 2) is 5. Intermediate results are plain numbers, only
+// the final result is made a lisp_cell. An operand that is not a number, or a division by zero, makes the result #f
+// without evaluating the rest.
+//
+// Integers and doubles mix: the fold stays in integers as long as every operand is one, and continues in doubles from
+// the first double on, so (/ 7 2 1.0) is 3.0 and (/ 1.0 7 2) is 0.0714... Doubles are immediates, a double result
+// allocates nothing.
+//
+// Integer operations are done in lisp_int_t with an overflow check. An operation that overflows is done again in
+// bigints, and the fold goes back to lisp_int_t as soon as a result fits again, so integers never wrap around.
+
+// an operand of the arithmetic and relational primitives
+struct number {
+    enum kind_t { INTEGER, BIG, DOUBLE };
+
+    kind_t kind = INTEGER;
+    lisp_int_t n = 0;
+    double d = 0;
+    bigint b;
+
+    // false if 'cell' is not a number
+    bool set(lisp_cell cell)
+    {
+        if (cell.isFixnum())
+        {
+            kind = INTEGER;
+            n = cell.fixnum();
+        }
+        else if (cell.isDouble())
+        {
+            kind = DOUBLE;
+            d = cell.flonum();
+        }
+        else if (cell.isObject(lisp_object::INTEGER))
+        {
+            const bigint &value = static_cast<lisp_integer *>(cell.object())->value();
+            kind = value.get(n) ? INTEGER : BIG;
+            if (kind == BIG)
+                b = value;
+        }
+        else
+            return false;
+        return true;
+    }
+    double to_double(void) const        { return kind == DOUBLE ? d : kind == BIG ? b.to_double() : static_cast<double>(n); }
+    bigint to_bigint(void) const        { return kind == BIG ? b : bigint(n); }
+    lisp_cell cell(void) const          { return kind == DOUBLE ? lisp_cell(d) : kind == BIG ? lisp_cell(b) : lisp_cell(n); }
+};
+
+// lisp_int_t arithmetic, false if the result overflows
+inline bool add_overflow(lisp_int_t a, lisp_int_t b, lisp_int_t &result)
+{
+#if defined(__GNUC__)
+    return __builtin_add_overflow(a, b, &result);
+#else
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b))
+        return true;
+    result = a + b;
+    return false;
+#endif
+}
+
+inline bool sub_overflow(lisp_int_t a, lisp_int_t b, lisp_int_t &result)
+{
+#if defined(__GNUC__)
+    return __builtin_sub_overflow(a, b, &result);
+#else
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b))
+        return true;
+    result = a - b;
+    return false;
+#endif
+}
+
+inline bool mul_overflow(lisp_int_t a, lisp_int_t b, lisp_int_t &result)
+{
+#if defined(__GNUC__)
+    return __builtin_mul_overflow(a, b, &result);
+#else
+    if (a != 0 && b != 0 && ((a == -1 && b == INT64_MIN) || (b == -1 && a == INT64_MIN) ||
+        (a != -1 && b != -1 && (a * b) / b != a)))
+        return true;
+    result = a * b;
+    return false;
+#endif
+}
+
+/* The arithmetic operators, n1 = n1 op n2 for each kind of operand. They return false for an undefined result, the
+ * lisp_int_t versions set 'overflow' instead of a result that does not fit.
+ */
+struct add_op {
+    bool operator()(lisp_int_t &n1, lisp_int_t n2, bool &overflow) const  { overflow = add_overflow(n1, n2, n1); return true; }
+    bool operator()(double &n1, double n2) const                          { n1 += n2; return true; }
+    bool operator()(bigint &n1, const bigint &n2) const                   { n1 = n1 + n2; return true; }
+};
+
+struct sub_op {
+    bool operator()(lisp_int_t &n1, lisp_int_t n2, bool &overflow) const  { overflow = sub_overflow(n1, n2, n1); return true; }
+    bool operator()(double &n1, double n2) const                          { n1 -= n2; return true; }
+    bool operator()(bigint &n1, const bigint &n2) const                   { n1 = n1 - n2; return true; }
+};
+
+struct mul_op {
+    bool operator()(lisp_int_t &n1, lisp_int_t n2, bool &overflow) const  { overflow = mul_overflow(n1, n2, n1); return true; }
+    bool operator()(double &n1, double n2) const                          { n1 *= n2; return true; }
+    bool operator()(bigint &n1, const bigint &n2) const                   { n1 = n1 * n2; return true; }
+};
+
+// integer division truncates towards zero
+struct div_op {
+    bool operator()(lisp_int_t &n1, lisp_int_t n2, bool &overflow) const
+    {
+        if (n2 == 0)
+            return false;
+        overflow = n1 == INT64_MIN && n2 == -1;
+        if (!overflow)
+            n1 /= n2;
+        return true;
+    }
+    bool operator()(double &n1, double n2) const
+    {
+        if (n2 == 0)
+            return false;
+        n1 /= n2;
+        return true;
+    }
+    bool operator()(bigint &n1, const bigint &n2) const
+    {
+        if (n2.is_zero())
+            return false;
+        bigint remainder;
+        bigint::divmod(n1, n2, n1, remainder);
+        return true;
+    }
+};
+
+// the truncated quotient of integers
+struct quotient_op: div_op {
+    using div_op::operator();
+    bool operator()(double &, double) const                               { return false; }
+};
+
+// the remainder of the truncating division, with the sign of the dividend. Integers only.
+struct remainder_op {
+    bool operator()(lisp_int_t &n1, lisp_int_t n2, bool &overflow) const
+    {
+        overflow = false;
+        if (n2 == 0)
+            return false;
+        n1 = n2 == -1 ? 0 : n1 % n2;
+        return true;
+    }
+    bool operator()(double &, double) const                               { return false; }
+    bool operator()(bigint &n1, const bigint &n2) const
+    {
+        if (n2.is_zero())
+            return false;
+        bigint quotient;
+        bigint::divmod(n1, n2, quotient, n1);
+        return true;
+    }
+};
+
+// the remainder of the floored division, with the sign of the divisor. Integers only.
+struct modulo_op {
+    bool operator()(lisp_int_t &n1, lisp_int_t n2, bool &overflow) const
+    {
+        if (!remainder_op()(n1, n2, overflow))
+            return false;
+        if (n1 != 0 && (n1 < 0) != (n2 < 0))
+            n1 += n2;
+        return true;
+    }
+    bool operator()(double &, double) const                               { return false; }
+    bool operator()(bigint &n1, const bigint &n2) const
+    {
+        if (!remainder_op()(n1, n2))
+            return false;
+        if (!n1.is_zero() && n1.is_negative() != n2.is_negative())
+            n1 = n1 + n2;
+        return true;
+    }
+};
+
+// n1 = n1 op n2, in lisp_int_t when both are integers and the result fits, in doubles when either is a double,
+// otherwise in bigints
+template <typename Op>
+inline bool arith(number &n1, const number &n2, Op op)
+{
+    if (n1.kind == number::INTEGER && n2.kind == number::INTEGER)
+    {
+        lisp_int_t n = n1.n;
+        bool overflow;
+        if (!op(n, n2.n, overflow))
+            return false;
+        if (!overflow)
+        {
+            n1.n = n;
+            return true;
+        }
+    }
+    if (n1.kind == number::DOUBLE || n2.kind == number::DOUBLE)
+    {
+        n1.d = n1.to_double();
+        n1.kind = number::DOUBLE;
+        return op(n1.d, n2.to_double());
+    }
+    n1.b = n1.to_bigint();
+    n1.kind = number::BIG;
+    if (!op(n1.b, n2.to_bigint()))
+        return false;
+    if (n1.b.get(n1.n))
+        n1.kind = number::INTEGER;
+    return true;
+}
+
+// 'op' is called as bool op(T n1, T n2), with T lisp_int_t, double, or int for bigints compared to 0
+template <typename Op>
+inline bool compare(const number &n1, const number &n2, Op op)
+{
+    if (n1.kind == number::INTEGER && n2.kind == number::INTEGER)
+        return op(n1.n, n2.n);
+    if (n1.kind == number::DOUBLE || n2.kind == number::DOUBLE)
+        return op(n1.to_double(), n2.to_double());
+    return op(n1.to_bigint().compare(n2.to_bigint()), 0);
+}
+
+template <typename Op>
+lisp_cell proc_arith(lisp_cell sexpr, environment *env, Op op)
+{
+    number n1, n2;
+    if (!sexpr.isLispCells() || !n1.set(eval(sexpr.car(), env)))
+        return false_sexpr;
+    sexpr = sexpr.cdr();
+
+    // the common two operand case
+    if (sexpr.isLispCells() && sexpr.cdr() == nullptr)
+    {
+        if (!n2.set(eval(sexpr.car(), env)) || !arith(n1, n2, op))
+            return false_sexpr;
+        return n1.cell();
+    }
+
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr())
+        if (!n2.set(eval(sexpr.car(), env)) || !arith(n1, n2, op))
+            return false_sexpr;
+    return n1.cell();
+}
+
+lisp_cell proc_add(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, add_op());
+}
+
+lisp_cell proc_sub(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, sub_op());
+}
+
+lisp_cell proc_mul(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, mul_op());
+}
+
+lisp_cell proc_div(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, div_op());
+}
+
+lisp_cell proc_quotient(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, quotient_op());
+}
+
+lisp_cell proc_remainder(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, remainder_op());
+}
+
+lisp_cell proc_modulo(lisp_cell sexpr, environment *env)
+{
+    return proc_arith(sexpr, env, modulo_op());
+}
+
+// Relational Primitives
+//
+// (< a b c) is (and (< a b) (< b c)). Like the arithmetic primitives, each operand is evaluated at most once, left to
+// right, and the first comparison that fails, or an operand that is not a number, makes the result #f without
+// evaluating the rest. An integer compared with a double is compared as a double.
+template <typename Op>
+lisp_cell proc_compare(lisp_cell sexpr, environment *env, Op op)
+{
+    number n1, n2;
+    if (!sexpr.isLispCells() || !n1.set(eval(sexpr.car(), env)))
+        return false_sexpr;
+    sexpr = sexpr.cdr();
+
+    // the common two operand case
+    if (sexpr.isLispCells() && sexpr.cdr() == nullptr)
+        return n2.set(eval(sexpr.car(), env)) && compare(n1, n2, op) ? true_sexpr : false_sexpr;
+
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr(), n1 = n2)
+        if (!n2.set(eval(sexpr.car(), env)) || !compare(n1, n2, op))
+            return false_sexpr;
+    return true_sexpr;
+}
+
+lisp_cell proc_cmpgt(lisp_cell sexpr, environment *env)
+{
+    return proc_compare(sexpr, env, [](auto n1, auto n2) { return n1>n2;});
+}
+
+lisp_cell proc_cmpge(lisp_cell sexpr, environment *env)
+{
+    return proc_compare(sexpr, env, [](auto n1, auto n2) { return n1>=n2;});
+}
+
+lisp_cell proc_cmplt(lisp_cell sexpr, environment *env)
+{
+    return proc_compare(sexpr, env, [](auto n1, auto n2) { return n1<n2;});
+}
+
+lisp_cell proc_cmple(lisp_cell sexpr, environment *env)
+{
+    return proc_compare(sexpr, env, [](auto n1, auto n2) { return n1<=n2;});
+}
+
+lisp_cell proc_cmpeq(lisp_cell sexpr, environment *env)
+{
+    return proc_compare(sexpr, env, [](auto n1, auto n2) { return n1==n2;});
+}
+
+lisp_cell proc_cmpne(lisp_cell sexpr, environment *env)
+{
+    return proc_compare(sexpr, env, [](auto n1, auto n2) { return n1!=n2;});
+}
+
+// List Processing
+lisp_cell eval_car(lisp_cell sexpr, environment *env)
+{
+    if (sexpr == nullptr)
+        return nil_sexpr;
+    sexpr = eval(sexpr.car(), env);
+    if (sexpr == nullptr || sexpr.isAtom())
+        return bad_sexpr;
+    return sexpr.car();
+}
+
+lisp_cell eval_cdr(lisp_cell sexpr, environment *env)
+{
+    if (sexpr == nullptr)
+        return nil_sexpr;
+    sexpr = eval(sexpr.car(), env);
+    if (sexpr == nullptr || sexpr.isAtom())
+        return bad_sexpr;
+    return sexpr.cdr();
+}
+
+lisp_cell eval_cons(lisp_cell sexpr, environment *env)
+{
+    if (!hasTwoOperands(sexpr))
+        return bad_sexpr;
+    lisp_cell car = eval(sexpr.car(), env);
+    gc_root root(car);
+    lisp_cell cdr = eval(sexpr.cdr().car(), env);
+    return lisp_cell(car, cdr);
+}
+
+// copy the list 'p' with 'tail' as its last cdr
+lisp_cell eval_append_impl(lisp_cell p, lisp_cell tail)
+{
+    lisp_cell head = tail, last;
+    gc_root root(p, tail, head, last);
+
+    for (; p != nullptr && p != nil_sexpr; p = p.cdr())
+    {
+        // an improper list's final atom becomes an element
+        lisp_cell cell = p.isAtom() ? lisp_cell(p, tail) : lisp_cell(p.car(), tail);
+        if (last == nullptr)
+            head = cell;
+        else
+            last.set_cdr(cell);
+        last = cell;
+        if (p.isAtom())
+            break;
+    }
+    return head;
+}
+
+lisp_cell eval_append(lisp_cell sexpr, environment *env)
+{
+    if (sexpr == nullptr)
+        return nil_sexpr;
+    lisp_cell val = eval(sexpr.car(), env);
+    if (val == nullptr || val.isAtom())
+        return nil_sexpr;
+
+    gc_root root(val);
+    lisp_cell tail = eval(sexpr.cdr().car(), env);
+    if (tail == nullptr || tail == nil_sexpr)
+        return val;
+
+    return eval_append_impl(val, tail);
+}
+
+lisp_int_t eval_length_impl(lisp_cell sexpr)
+{
+    lisp_int_t n = 0;
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr())
+        n++;
+    return n;
+}
+
+lisp_cell eval_length(lisp_cell sexpr, environment *env)
+{
+    lisp_cell val = eval(sexpr.car(), env);
+    lisp_vector *v;
+    if (val.isVector(v))
+        return lisp_cell(static_cast<lisp_int_t>(v->size()));
+    lisp_int_t n = eval_length_impl(val);
+
+    return lisp_cell(n);
+}
+
+lisp_cell eval_nullp(lisp_cell sexpr, environment *env)
+{
+    lisp_cell val = eval(sexpr.car(), env);
+    if (val == nullptr || val == nil_sexpr)
+        return true_sexpr;
+    return false_sexpr;
+}
+
+lisp_cell eval_not(lisp_cell sexpr, environment *env)
+{
+    lisp_cell val = eval(sexpr.car(), env);
+    if (val == nullptr || val == nil_sexpr || val == false_sexpr)
+        return true_sexpr;
+    return false_sexpr;
+}
+
+// Vectors
+//
+// A vector is a fixed size array of values, #(1 2 3) when read or printed, with its elements stored contiguously:
+// vector-ref, vector-set! and vector-length are O(1). An index out of range, a size above lisp_vector::MAX_SIZE, or
+// an argument that is not a vector, makes the result #error.
+
+// a new vector with the elements of the list 'list'
+lisp_cell list_to_vector(lisp_cell list)
+{
+    gc_root root(list);
+    size_t n = eval_length_impl(list);
+    if (n > lisp_vector::MAX_SIZE)
+        return bad_sexpr;
+    lisp_vector *v = new (n) lisp_vector(n);
+    for (size_t i = 0; i < n; i++, list = list.cdr())
+        v->set(i, list.car());
+    return lisp_cell(v);
+}
+
+// evaluate a vector and an index into it
+bool eval_vector_index(lisp_cell sexpr, environment *env, lisp_vector *&v, size_t &index)
+{
+    lisp_int_t i;
+    if (!sexpr.isLispCells() || !eval(sexpr.car(), env).isVector(v))
+        return false;
+    gc_root root(v);
+    if (!eval(sexpr.cdr().car(), env).getValue<lisp_int_t>(i) || i < 0 || static_cast<size_t>(i) >= v->size())
+        return false;
+    index = static_cast<size_t>(i);
+    return true;
+}
+
+// (make-vector n) or (make-vector n fill)
+lisp_cell eval_make_vector(lisp_cell sexpr, environment *env)
+{
+    lisp_int_t n;
+    if (!sexpr.isLispCells() || !eval(sexpr.car(), env).getValue<lisp_int_t>(n) || n < 0 ||
+        static_cast<size_t>(n) > lisp_vector::MAX_SIZE)
+        return bad_sexpr;
+    lisp_cell fill = sexpr.cdr().isLispCells() ? eval(sexpr.cdr().car(), env) : nil_sexpr;
+    gc_root root(fill);
+
+    lisp_vector *v = new (static_cast<size_t>(n)) lisp_vector(static_cast<size_t>(n));
+    if (fill != nil_sexpr)
+        for (size_t i = 0; i < v->size(); i++)
+            v->set(i, fill);
+    return lisp_cell(v);
+}
+
+// (vector a b ...)
+lisp_cell eval_vector(lisp_cell sexpr, environment *env)
+{
+    // the evaluated elements are kept on the argument stack, where they are roots
+    size_t n = 0;
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr(), n++)
+        gc.push_argument(eval(sexpr.car(), env));
+    if (n > lisp_vector::MAX_SIZE)
+    {
+        gc.pop_arguments(n);
+        return bad_sexpr;
+    }
+
+    lisp_vector *v = new (n) lisp_vector(n);
+    const lisp_cell *elements = gc.top_arguments(n);
+    for (size_t i = 0; i < n; i++)
+        v->set(i, elements[i]);
+    gc.pop_arguments(n);
+    return lisp_cell(v);
+}
+
+lisp_cell eval_vector_ref(lisp_cell sexpr, environment *env)
+{
+    lisp_vector *v;
+    size_t i;
+    if (!eval_vector_index(sexpr, env, v, i))
+        return bad_sexpr;
+    return v->get(i);
+}
+
+// (vector-set! v i value), returns value
+lisp_cell eval_vector_set(lisp_cell sexpr, environment *env)
+{
+    lisp_vector *v;
+    size_t i;
+    if (!eval_vector_index(sexpr, env, v, i))
+        return bad_sexpr;
+    gc_root root(v);
+    lisp_cell val = eval(sexpr.cdr().cdr().car(), env);
+    v->set(i, val);
+    return val;
+}
+
+lisp_cell eval_vector_length(lisp_cell sexpr, environment *env)
+{
+    lisp_vector *v;
+    if (sexpr == nullptr || !eval(sexpr.car(), env).isVector(v))
+        return bad_sexpr;
+    return lisp_cell(static_cast<lisp_int_t>(v->size()));
+}
+
+lisp_cell eval_vector_to_list(lisp_cell sexpr, environment *env)
+{
+    lisp_vector *v;
+    if (sexpr == nullptr || !eval(sexpr.car(), env).isVector(v))
+        return bad_sexpr;
+    if (v->size() == 0)
+        return nil_sexpr;
+
+    lisp_cell list;
+    gc_root root(v, list);
+    for (size_t i = v->size(); i-- > 0; )
+        list = lisp_cell(v->get(i), list);
+    return list;
+}
+
+lisp_cell eval_list_to_vector(lisp_cell sexpr, environment *env)
+{
+    if (sexpr == nullptr)
+        return bad_sexpr;
+    return list_to_vector(eval(sexpr.car(), env));
+}
+
+// Hash tables
+//
+// (make-hash-table) or (make-hash-table size) makes an empty table, with room for 'size' entries before it grows.
+// Keys are compared with eq, and strings and integers by value. A table argument that is not a hash table, or a size
+// above lisp_hash_table::MAX_PRESIZE, makes the result #error.
+
+lisp_cell eval_make_hash_table(lisp_cell sexpr, environment *env)
+{
+    lisp_int_t size = 0;
+    if (sexpr.isLispCells() && (!eval(sexpr.car(), env).getValue<lisp_int_t>(size) || size < 0 ||
+                                static_cast<size_t>(size) > lisp_hash_table::MAX_PRESIZE))
+        return bad_sexpr;
+    return lisp_cell(new lisp_hash_table(static_cast<size_t>(size)));
+}
+
+// evaluate the table and the key of (hash-table-... table key ...), the caller roots them
+bool eval_hash_table_key(lisp_cell sexpr, environment *env, lisp_hash_table *&h, lisp_cell &key)
+{
+    if (!sexpr.isLispCells() || !eval(sexpr.car(), env).getValue<lisp_hash_table *>(h))
+        return false;
+    gc_root root(h);
+    key = eval(sexpr.cdr().car(), env);
+    return true;
+}
+
+// (hash-table-ref table key) or (hash-table-ref table key default), the default is #f
+lisp_cell eval_hash_table_ref(lisp_cell sexpr, environment *env)
+{
+    lisp_hash_table *h;
+    lisp_cell key, val;
+    if (!eval_hash_table_key(sexpr, env, h, key))
+        return bad_sexpr;
+    if (h->find(key, val))
+        return val;
+    sexpr = sexpr.cdr().cdr();
+    return sexpr.isLispCells() ? eval(sexpr.car(), env) : false_sexpr;
+}
+
+// (hash-table-set! table key value), returns value
+lisp_cell eval_hash_table_set(lisp_cell sexpr, environment *env)
+{
+    lisp_hash_table *h;
+    lisp_cell key;
+    if (!eval_hash_table_key(sexpr, env, h, key))
+        return bad_sexpr;
+    gc_root root(h, key);
+    lisp_cell val = eval(sexpr.cdr().cdr().car(), env);
+    h->insert(key, val);
+    return val;
+}
+
+// (hash-table-delete! table key) is #t if the key was in the table
+lisp_cell eval_hash_table_delete(lisp_cell sexpr, environment *env)
+{
+    lisp_hash_table *h;
+    lisp_cell key;
+    if (!eval_hash_table_key(sexpr, env, h, key))
+        return bad_sexpr;
+    return h->remove(key) ? true_sexpr : false_sexpr;
+}
+
+lisp_cell eval_hash_table_contains(lisp_cell sexpr, environment *env)
+{
+    lisp_hash_table *h;
+    lisp_cell key, val;
+    if (!eval_hash_table_key(sexpr, env, h, key))
+        return bad_sexpr;
+    return h->find(key, val) ? true_sexpr : false_sexpr;
+}
+
+lisp_cell eval_hash_table_count(lisp_cell sexpr, environment *env)
+{
+    lisp_hash_table *h;
+    if (sexpr == nullptr || !eval(sexpr.car(), env).getValue<lisp_hash_table *>(h))
+        return bad_sexpr;
+    return lisp_cell(static_cast<lisp_int_t>(h->count()));
+}
+
+// the keys, values or (key . value) pairs of a table, in no particular order
+enum hash_table_items { HASH_TABLE_KEYS, HASH_TABLE_VALUES, HASH_TABLE_PAIRS };
+
+lisp_cell hash_table_list(lisp_cell sexpr, environment *env, hash_table_items items)
+{
+    lisp_hash_table *h;
+    if (sexpr == nullptr || !eval(sexpr.car(), env).getValue<lisp_hash_table *>(h))
+        return bad_sexpr;
+
+    lisp_cell list, item;
+    gc_root root(h, list, item);
+    for (size_t i = 0; i < h->capacity(); i++)
+    {
+        if (h->key(i) == unbound_sexpr)
+            continue;
+        if (items == HASH_TABLE_PAIRS)
+            item = lisp_cell(h->key(i), h->value(i));
+        else
+            item = items == HASH_TABLE_KEYS ? h->key(i) : h->value(i);
+        list = lisp_cell(item, list);
+    }
+    return list == nullptr ? nil_sexpr : list;
+}
+
+lisp_cell eval_hash_table_keys(lisp_cell sexpr, environment *env)
+{
+    return hash_table_list(sexpr, env, HASH_TABLE_KEYS);
+}
+
+lisp_cell eval_hash_table_values(lisp_cell sexpr, environment *env)
+{
+    return hash_table_list(sexpr, env, HASH_TABLE_VALUES);
+}
+
+lisp_cell eval_hash_table_to_alist(lisp_cell sexpr, environment *env)
+{
+    return hash_table_list(sexpr, env, HASH_TABLE_PAIRS);
+}
+
+/* Special forms with an expression in tail position
+ *
+ * The tail function of a special form evaluates the form up to the expression in tail position and returns that
+ * expression, which eval then evaluates in its loop, see eval. If the value of the form is known before that, it
+ * returns the value and sets 'done'.
+ */
+
+// evaluate a special form with its tail function, outside of eval's loop
+lisp_cell eval_tail(tail_type tail, lisp_cell sexpr, environment *env)
+{
+    bool done;
+    lisp_cell val = tail(sexpr, env, done);
+    return done ? val : eval(val, env);
+}
+
+// (and ...) is #f as soon as an expression is #f, else the value of the last expression
+lisp_cell tail_and(lisp_cell sexpr, environment *env, bool &done)
+{
+    done = true;
+    if (sexpr == nullptr)
+        return false_sexpr;
+
+    for (; sexpr.cdr() != nullptr; sexpr = sexpr.cdr())
+        if (eval(sexpr.car(), env) == false_sexpr)
+            return false_sexpr;
+    done = false;
+    return sexpr.car();
+}
+
+lisp_cell eval_and(lisp_cell sexpr, environment *env)
+{
+    return eval_tail(tail_and, sexpr, env);
+}
+
+// (or ...) is the value of the first expression that is not #f, else the value of the last expression
+lisp_cell tail_or(lisp_cell sexpr, environment *env, bool &done)
+{
+    done = true;
+    if (sexpr == nullptr)
+        return false_sexpr;
+
+    for (; sexpr.cdr() != nullptr; sexpr = sexpr.cdr())
+    {
+        lisp_cell val = eval(sexpr.car(), env);
+        if (val != false_sexpr)
+            return val;
+    }
+    done = false;
+    return sexpr.car();
+}
+
+lisp_cell eval_or(lisp_cell sexpr, environment *env)
+{
+    return eval_tail(tail_or, sexpr, env);
+}
+
+lisp_cell eval_list(lisp_cell sexpr, environment *env)
+{
+    if (sexpr == nullptr)
+        return nil_sexpr;
+
+    if (sexpr.isAtom())
+        return eval(sexpr, env);
+
+    lisp_cell head, last;
+    gc_root root(head, last);
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr())
+    {
+        lisp_cell cell(eval(sexpr.car(), env), nullptr);
+        if (last == nullptr)
+            head = cell;
+        else
+            last.set_cdr(cell);
+        last = cell;
+    }
+    return head;
+}
+
+// Eval Primitives
+lisp_cell tail_if(lisp_cell sexpr, environment *env, bool &done)
 {
-    if (sexpr == nullptr)
-        return false_sexpr;
+    done = !hasTwoOperands(sexpr);
+    if (done)
+        return bad_sexpr;
+
+    lisp_cell car = sexpr.car();
+    lisp_cell cdr = sexpr.cdr();
+
+    lisp_cell val = eval(car, env);
+    if (val != false_sexpr)
+        return cdr.car();
+    return cdr.cdr().car();
+}
+
+lisp_cell eval_if(lisp_cell sexpr, environment *env)
+{
+    return eval_tail(tail_if, sexpr, env);
+}
+
+// Handle both
+//  define: current_scope_only
+//  set!:   search up and scope and do not create variable if not found
+// assign 'val' to 'target', a local variable or a symbol. Returns 'val', or nil if setq finds no variable
+lisp_cell set_variable(lisp_cell target, lisp_cell val, environment *env, bool is_define)
+{
+    if (target.isLocal())
+    {
+        if (env->UpdateLocal(target, val, is_define))
+            return val;
+        std::cout << "Variable '" << env->LocalName(target)->name() << "' does not exist." << std::endl;
+        return nil_sexpr;
+    }
+
+    symbol *s = target.sym();
+    if (env->UpdateSymbol(s, val, is_define))
+        return val;
+
+    // only when is_define == false, setq
+    std::cout << "Variable '" << s->name() << "' does not exist." << std::endl;
+    return nil_sexpr;
+}
+
+lisp_cell eval_set(lisp_cell sexpr, environment *env, bool is_define)
+{
+    if (!hasTwoOperands(sexpr))
+        return bad_sexpr;
+
+    lisp_cell target = sexpr.car();
+    if (!target.isLocal() && !target.isSymbol())
+        return bad_sexpr;
+
+    return set_variable(target, eval(sexpr.cdr().car(), env), env, is_define);
+}
+
+lisp_cell eval_setq(lisp_cell sexpr, environment *env)
+{
+    return eval_set(sexpr, env, false);
+}
+
+lisp_cell eval_define(lisp_cell sexpr, environment *env)
+{
+    return eval_set(sexpr, env, true);
+}
+
+// (begin ...) and lambda bodies
+lisp_cell tail_begin(lisp_cell sexpr, environment *env, bool &done)
+{
+    done = !sexpr.isLispCells();
+    if (done)
+        return nil_sexpr;
+
+    for (; sexpr.cdr().isLispCells(); sexpr = sexpr.cdr())
+        eval(sexpr.car(), env);
+    return sexpr.car();
+}
+
+lisp_cell eval_begin(lisp_cell sexpr, environment *env)
+{
+    return eval_tail(tail_begin, sexpr, env);
+}
+
+// bind 'name' to a built-in function. The value cell is made first: interning the name and adding the cell may
+// collect, and the new lisp_proc must not be unrooted when that happens
+void define_builtin(environment &env, const std::string &name, proc_type func, tail_type tail = nullptr)
+{
+    lisp_cell &cell = env[name];
+    cell = lisp_cell(new lisp_proc(func, tail));
+}
+
+// Primitive functions
+void add_globals(environment &env)
+{
+    gc.add_root(&env);
+    define_builtin(env, "+", &proc_add);
+    define_builtin(env, "-", &proc_sub);
+    define_builtin(env, "*", &proc_mul);
+    define_builtin(env, "/", &proc_div);
+    define_builtin(env, "quotient", &proc_quotient);
+    define_builtin(env, "remainder", &proc_remainder);
+    define_builtin(env, "modulo", &proc_modulo);
+    define_builtin(env, ">", &proc_cmpgt);
+    define_builtin(env, "<", &proc_cmplt);
+    define_builtin(env, "<=", &proc_cmple);
+    define_builtin(env, ">=", &proc_cmpge);
+    define_builtin(env, "eq", &proc_cmpeq);
+    define_builtin(env, "ne", &proc_cmpne);
+
+    define_builtin(env, "and", &eval_and, &tail_and);
+    define_builtin(env, "append", &eval_append);
+    define_builtin(env, "begin", &eval_begin, &tail_begin);
+    define_builtin(env, "car", &eval_car);
+    define_builtin(env, "cdr", &eval_cdr);
+    define_builtin(env, "cons", &eval_cons);
+    define_builtin(env, "define", &eval_define);
+    define_builtin(env, "hash-table->alist", &eval_hash_table_to_alist);
+    define_builtin(env, "hash-table-contains?", &eval_hash_table_contains);
+    define_builtin(env, "hash-table-count", &eval_hash_table_count);
+    define_builtin(env, "hash-table-delete!", &eval_hash_table_delete);
+    define_builtin(env, "hash-table-keys", &eval_hash_table_keys);
+    define_builtin(env, "hash-table-ref", &eval_hash_table_ref);
+    define_builtin(env, "hash-table-set!", &eval_hash_table_set);
+    define_builtin(env, "hash-table-values", &eval_hash_table_values);
+    define_builtin(env, "if", &eval_if, &tail_if);
+    define_builtin(env, "length", &eval_length);
+    define_builtin(env, "list", &eval_list);
+    define_builtin(env, "list->vector", &eval_list_to_vector);
+    define_builtin(env, "make-hash-table", &eval_make_hash_table);
+    define_builtin(env, "make-vector", &eval_make_vector);
+    define_builtin(env, "not", &eval_not);
+    define_builtin(env, "nullp", &eval_nullp);
+    define_builtin(env, "or", &eval_or, &tail_or);
+    define_builtin(env, "setq", &eval_setq);
+    define_builtin(env, "vector", &eval_vector);
+    define_builtin(env, "vector->list", &eval_vector_to_list);
+    define_builtin(env, "vector-length", &eval_vector_length);
+    define_builtin(env, "vector-ref", &eval_vector_ref);
+    define_builtin(env, "vector-set!", &eval_vector_set);
+}
+
+lisp_cell eval_proc(lisp_cell proc, lisp_cell func_body, environment *env)
+{
+    proc_type native_func;
+
+    if (proc.getValue<proc_type>(native_func))
+        return native_func(func_body, env);
+
+    return nil_sexpr;
+}
+
+// check the number of arguments of a call of 'code'
+bool check_arguments(lambda_code *code, size_t nargs)
+{
+    if (nargs < code->nparams())
+        std::cout << "insufficient number of argument(s)" << std::endl;
+    else if (nargs > code->nparams())
+        std::cout << "too many argument(s)" << std::endl;
+    else
+        return true;
+    return false;
+}
+
+// evaluate the arguments of a call of 'code' in the caller's environment 'env' and push them on the argument stack.
+// Returns false, with nothing pushed, if the number of arguments is wrong.
+bool eval_arguments(lambda_code *code, lisp_cell args, environment *env)
+{
+    uint32_t nparams = code->nparams();
+    uint32_t i = 0;
+
+    // (params) <- (args)
+    for (; i < nparams && args != nullptr; i++, args = args.cdr())
+        gc.push_argument(code->name(i) != nullptr ? eval(args.car(), env) : unbound_sexpr);
+
+    if (check_arguments(code, args != nullptr ? i + 1 : i))
+        return true;
+    gc.pop_arguments(i);
+    return false;
+}
+
+/* tail_frame is the frame of the lambda an activation of eval is running. A call in tail position replaces it, so that
+ * a chain of tail calls holds one frame at a time. The frame lives on the frame stack: closures copy the variables they
+ * use out of it (see "Lexical addressing"), so it is released when it is replaced or when eval returns.
+ */
+class tail_frame {
+public:
+    tail_frame(): on_stack_(false) {}
+    ~tail_frame()                                   { release(); }
+
+    tail_frame(const tail_frame &) = delete;
+    tail_frame &operator=(const tail_frame &) = delete;
+
+    // release the current frame and enter a new one for a call of 'closure', binding the arguments pushed by
+    // eval_arguments
+    environment *enter(lambda *closure)
+    {
+        release();
+
+        lambda_code *code = closure->code();
+        environment *frame = environment::push_frame(closure);
+        on_stack_ = true;
+        frame->bind(gc.top_arguments(code->nparams()));
+        gc.pop_arguments(code->nparams());
+        if (!code->boxed().empty())
+            frame->box();
+        return frame;
+    }
+
+    void release(void)
+    {
+        if (on_stack_)
+            gc.pop_frame();
+        on_stack_ = false;
+    }
+
+private:
+    bool on_stack_;
+};
+
+lisp_cell eval_lambda(lambda *l, lisp_cell args, environment *env)
+{
+    gc_root root(l);
+    if (!eval_arguments(l->code(), args, env))
+        return nil_sexpr;
+
+    tail_frame frame;
+    return eval_begin(l->body(), frame.enter(l));
+}
+
+lisp_cell eval_lambda(lisp_cell sexpr, lisp_cell args, environment *env)
+{
+    lambda *l;
+
+    if (sexpr.getValue<lambda *>(l))
+        return eval_lambda(l, args, env);
+    return nil_sexpr;
+}
+
+/* Lexical addressing
+ *
+ * A lambda body is resolved once, when makeLambda creates the lambda, so that evaluating it needs no symbol lookup for
+ * parameters and local variables. Every reference to a parameter or a local variable (a symbol "define"d in the body) of
+ * the lambda is rewritten to a lisp_cell::local, the index of its slot in the frame. A local variable is local to the
+ * whole body, and unbound until its define has run. Nested lambda forms are resolved along with the body and become
+ * lambda_code objects, which evaluate to a lambda. The head of a call of a global function or special form becomes a
+ * global_ref, which caches the value cell of the function. Other global variables and quoted data are left alone.
+ *
+ * Closures are flat: a reference to a variable of an enclosing lambda (a free variable) is rewritten to a captured
+ * variable of the lambda, and every lambda in between captures it too. A closure copies its captured variables from the
+ * frame (or the closure) it is created in, so it uses one slot per variable it needs and keeps nothing else alive, and
+ * frames can always live on the frame stack. A variable that is both captured and assigned, by setq or by its define, is
+ * held in a lisp_box made when the frame is entered, and the closures copy the box, so that all of them share it.
+ *
+ * The resolved code is a copy allocated in the old generation, like the program text it comes from.
+ */
+
+// the lambdas whose variables are visible from a lambda body, innermost first
+struct lexical_scope {
+    lambda_code *code;
+    const lexical_scope *outer;
+};
+
+// the variable of 'code' named 's', a slot or a captured variable, or nullptr
+lisp_cell find_variable(symbol *s, const lambda_code *code)
+{
+    // search from the end, the last of two parameters with the same name is bound last
+    const std::vector<symbol *> &names = code->names();
+    for (size_t slot = names.size(); slot-- > 0; )
+        if (names[slot] == s)
+            return lisp_cell::local(false, static_cast<uint32_t>(slot));
+    for (uint32_t i = 0; i < code->ncaptured(); i++)
+        if (code->captured_name(i) == s)
+            return lisp_cell::local(true, i);
+    return nullptr;
+}
+
+// the local variable 's' refers to in the innermost lambda of 'scope', capturing it from the enclosing lambdas if
+// needed, or the symbol itself if it is not a local variable
+lisp_cell resolve_symbol(symbol *s, const lexical_scope *scope)
+{
+    if (scope == nullptr)
+        return lisp_cell(s);
+    lisp_cell var = find_variable(s, scope->code);
+    if (var != nullptr)
+        return var;
+
+    var = resolve_symbol(s, scope->outer);
+    if (!var.isLocal())
+        return var;
+    if (!var.captured())
+        scope->outer->code->set_captured(var.slot());
+    return lisp_cell::local(true, scope->code->add_capture(var, s));
+}
+
+// the local variable 'var' of the innermost lambda of 'scope' is assigned: flag the slot holding it
+void assign_variable(lisp_cell var, const lexical_scope *scope)
+{
+    for (; var.captured(); scope = scope->outer)
+        var = scope->code->capture(var.slot());
+    scope->code->set_assigned(var.slot());
+}
+
+// add the variables defined by the forms in the list 'sexpr' to the locals of 'code'. Quoted data and nested lambdas
+// are not searched.
+void collect_locals(lisp_cell sexpr, lambda_code *code)
+{
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr())
+    {
+        lisp_cell form = sexpr.car();
+        if (!form.isLispCells())
+            continue;
+
+        symbol *s;
+        if (form.car().isSymbol(s))
+        {
+            if (s == sym_quote || s == sym_lambda)
+                continue;
+            symbol *var;
+            if (s == sym_define && form.cdr().car().isSymbol(var))
+                code->add_local(var);
+        }
+        collect_locals(form, code);
+    }
+}
+
+lisp_cell resolve(lisp_cell sexpr, const lexical_scope *scope);
+lambda_code *resolve_lambda(lisp_cell sexpr, const lexical_scope *outer);
+
+// a copy of the list 'sexpr' with every element resolved
+lisp_cell resolve_list(lisp_cell sexpr, const lexical_scope *scope)
+{
+    lisp_cell head = nullptr;
+    lisp_cell last = nullptr;
+    gc_root root(sexpr, head, last);
+
+    for (; sexpr.isLispCells(); sexpr = sexpr.cdr())
+    {
+        lisp_cell cell(gc.allocate_old_cons(resolve(sexpr.car(), scope), nullptr));
+        if (head == nullptr)
+            head = cell;
+        else
+            last.set_cdr(cell);
+        last = cell;
+    }
+    if (sexpr != nullptr && last != nullptr)
+        last.set_cdr(sexpr);
+    return head;
+}
+
+// resolve the expression 'sexpr'
+lisp_cell resolve(lisp_cell sexpr, const lexical_scope *scope)
+{
+    symbol *s;
+    if (sexpr.isSymbol(s))
+        return resolve_symbol(s, scope);
+    if (!sexpr.isLispCells())
+        return sexpr;
+
+    // quote and lambda, unless the name is a local variable
+    if (!sexpr.car().isSymbol(s) || !resolve_symbol(s, scope).isSymbol())
+        s = nullptr;
+    if (s != nullptr)
+    {
+        if (s == sym_quote)
+            return sexpr;
+        if (s == sym_lambda)
+        {
+            lambda_code *code = resolve_lambda(sexpr, scope);
+            return code != nullptr ? lisp_cell(code) : sexpr;
+        }
+    }
+
+    lisp_cell resolved = resolve_list(sexpr, scope);
+    // (define var ...) and (setq var ...) of a local variable
+    if ((s == sym_define || s == sym_setq) && resolved.cdr().isLispCells() && resolved.cdr().car().isLocal())
+        assign_variable(resolved.cdr().car(), scope);
+    // the call of a global function caches its value cell
+    if (s != nullptr)
+    {
+        gc_root root(resolved);
+        resolved.set_car(lisp_cell(new global_ref(s)));
+    }
+    return resolved;
+}
+
+// resolve the lambda form 'sexpr', in the scope 'outer'. Returns nullptr if the form is malformed.
+lambda_code *resolve_lambda(lisp_cell sexpr, const lexical_scope *outer)
+{
+    // ensure we have an parameter list, even if empty, and a body
+    // (lambda (args) body...)
+    if (sexpr.cdr() == nullptr ||
+        !sexpr.cdr().isLispCells() ||
+        (sexpr.cdr().car() != nullptr &&           // params
+         !sexpr.cdr().car().isLispCells()) ||
+        sexpr.cdr().cdr() == nullptr)              // body
+        return nullptr;
+
+    lambda_code *code = new lambda_code(sexpr.cdr().car());
+    gc_root root(sexpr, code);
+
+    symbol *s;
+    for (lisp_cell params = code->params(); params != nullptr; params = params.cdr())
+        code->add_param(params.car().isSymbol(s) ? s : nullptr);
+    collect_locals(sexpr.cdr().cdr(), code);
+
+    lexical_scope scope = { code, outer };
+    code->set_body(resolve_list(sexpr.cdr().cdr(), &scope));
+    return code;
+}
+
+lisp_cell makeLambda(lisp_cell sexpr, environment *env)
+{
+    // the variables of the frame 'env', if it is one, are visible. Its own frame is entered already, so a variable
+    // the new lambda captures is copied even if it is assigned.
+    lexical_scope frame = { env->code(), nullptr };
+    lambda_code *code = resolve_lambda(sexpr, env->code() != nullptr ? &frame : nullptr);
+    if (code == nullptr)
+        return nullptr;
+    gc_root root(code, env);
+    return lisp_cell(new (code->ncaptured()) lambda(code, env));
+}
+
+// evaluate an atom
+lisp_cell eval_atom(lisp_cell sexpr, environment *env)
+{
+    if (sexpr == nullptr || sexpr.isImmediate() || sexpr.isConstant())
+        return sexpr;
+
+    lisp_cell val;
+    symbol *s;
+
+    // parameter or local variable
+    if (sexpr.isLocal())
+    {
+        if (env->FindLocal(sexpr, val))
+            return val;
+        return nil_sexpr;
+    }
+
+    // Symbol
+    if (sexpr.isSymbol(s))
+    {
+        if (env->FindSymbol(s, val))
+            return val;
+        return nil_sexpr;
+    }
+
+    // a lambda form resolved along with the body it is in
+    if (sexpr.isObject(lisp_object::CODE))
+    {
+        lambda_code *code = static_cast<lambda_code *>(sexpr.object());
+        return lisp_cell(new (code->ncaptured()) lambda(code, env));
+    }
+
+    // built-in functions and lambdas evaluate to themselves
+    return sexpr;
+}
+
+// EVAL, evaluate an S-expression
+//
+// eval is a trampoline: the expression in tail position of a special form (see tail_if) or of a lambda body is not
+// evaluated by a recursive call but by the next round of the loop, and a lambda called there replaces the frame of the
+// previous one (see tail_frame). Tail recursion runs in constant C++ stack and frame space.
+lisp_cell eval(lisp_cell sexpr, environment *env)
+{
+    if (sexpr.isAtom())
+        return eval_atom(sexpr, env);
+
+    tail_frame frame;
+    for (;;)
+    {
+        if (sexpr.isAtom())
+            return eval_atom(sexpr, env);
+
+        lisp_cell car = sexpr.car();
+        if (car == nullptr || car.isImmediate() || car.isConstant())
+            return bad_sexpr;
+
+        lisp_cell val;
+        symbol *s;
+        // a call in a resolved lambda body
+        if (car.isObject(lisp_object::GLOBAL))
+        {
+            if (env->FindGlobal(static_cast<global_ref *>(car.object()), val) == false)
+                return bad_sexpr;
+        }
+        else if (car.isSymbol(s))
+        {
+            if (s == sym_quote)
+                return sexpr.cdr().car();
+            if (s == sym_lambda)
+                return makeLambda(sexpr, env);
+
+            if (env->FindSymbol(s, val) == false)
+                return bad_sexpr;
+        }
+        // ((lambda (a) ...) args) or any other expression evaluating to a function
+        else
+            val = eval(car, env);
+
+        bool done;
+        lambda *l;
+        if (val.isLambda(l))
+        {
+            gc_root root(l);
+            if (!eval_arguments(l->code(), sexpr.cdr(), env))
+                return nil_sexpr;
+            if (use_vm)
+                return vm_execute(l, l->code()->nparams());
+            env = frame.enter(l);
+            sexpr = tail_begin(l->body(), env, done);
+        }
+        else if (val.isObject(lisp_object::PROC))
+        {
+            lisp_proc *proc = static_cast<lisp_proc *>(val.object());
+            if (proc->tail() == nullptr)
+                return proc->func()(sexpr.cdr(), env);
+            sexpr = proc->tail()(sexpr.cdr(), env, done);
+        }
+        else
+            return nil_sexpr;
+
+        if (done)
+            return sexpr;
+    }
+}
+
+/* Bytecode compiler and VM
+ *
+ * With use_vm set, a lambda is compiled to bytecode the first time it is called, and run by vm_execute. The VM is a
+ * stack machine: operands and call arguments live on the gc argument stack, and variables in the same frames the tree
+ * walker uses, so the two can call each other. eval remains the reference semantics.
+ *
+ * The special forms and a few primitives (car, cdr, +, -, <) are compiled inline, when the global symbol naming them is
+ * bound to the built-in function at compile time. Assigning a variable holding a built-in function invalidates all
+ * bytecode, which is then compiled again on the next call. The new bytecode replaces the old one, which is freed as soon
+ * as no vm_execute call is running it. Other forms are compiled as calls: a lambda gets its arguments evaluated on the
+ * stack, a built-in function gets the unevaluated argument list, as with eval. A lambda called with the wrong number of
+ * arguments, or with a parameter that is not a symbol, gets them from eval_arguments, which checks the arity before
+ * evaluating any. Inlined primitives evaluate all their operands, even when the first one is not a number.
+ */
+enum opcode_t : uint32_t {
+    OP_CONST,           // k            push constants[k]
+    OP_LOCAL,           // captured slot    push a local variable
+    OP_GLOBAL,          // k            push the value of the symbol constants[k]
+    OP_FUNCTION,        // k target     push the value of the global_ref constants[k], or #error and jump if undefined
+    OP_SET_LOCAL,       // captured slot define assign the value on top to a local variable
+    OP_SET_GLOBAL,      // k define     assign the value on top to the symbol constants[k]
+    OP_POP,             //              pop
+    OP_JUMP,            // target       jump
+    OP_JUMP_FALSE,      // target       pop, jump if #f
+    OP_AND,             // target       jump if #f, else pop
+    OP_OR,              // target       jump unless #f, else pop
+    OP_CLOSURE,         // k            push a lambda of the lambda_code constants[k]
+    OP_PROC_CALL,       // k target n   unless the function on top is a lambda taking the n arguments, call it with
+                        //              the argument list constants[k] and jump
+    OP_CALL,            // n            call the lambda below the n arguments on top
+    OP_TAIL_CALL,       // n            same, replacing the running lambda
+    OP_RETURN,          //              return the value on top
+    OP_CAR,             //              replace the value on top by its car
+    OP_CDR,             //              replace the value on top by its cdr
+    OP_ADD,             //              replace the two values on top by their sum
+    OP_SUB,             //              ... difference
+    OP_LT,              //              ... comparison
+    OP_EVAL             // k            push the value of the expression constants[k], evaluated by eval
+};
+
+class compiler {
+public:
+    // 'env' is the environment the lambda was created in, for looking up the built-in functions
+    compiler(bytecode &bc, environment *env): bc_(bc), env_(env) {}
+
+    // compile a lambda body
+    void compile_body(lisp_cell body)
+    {
+        compile_sequence(body, true);
+        emit(OP_RETURN);
+    }
+
+private:
+    void emit(uint32_t word)                { bc_.code.push_back(word); }
+    uint32_t here(void) const               { return static_cast<uint32_t>(bc_.code.size()); }
+    // emit the target operand of a jump, returning its position for patch
+    uint32_t emit_target(void)
+    {
+        emit(0);
+        return here() - 1;
+    }
+    uint32_t emit_jump(uint32_t op)
+    {
+        emit(op);
+        return emit_target();
+    }
+    void patch(uint32_t at)                 { bc_.code[at] = here(); }
+
+    uint32_t constant(lisp_cell cell)
+    {
+        for (size_t k = 0; k < bc_.constants.size(); k++)
+            if (bc_.constants[k] == cell)
+                return static_cast<uint32_t>(k);
+        bc_.constants.push_back(cell);
+        return static_cast<uint32_t>(bc_.constants.size() - 1);
+    }
+
+    // the built-in function the global_ref 'head' names, or nullptr
+    proc_type builtin(lisp_cell head)
+    {
+        lisp_cell val;
+        proc_type func;
+        if (head.isObject(lisp_object::GLOBAL) &&
+            env_->LookupSymbol(static_cast<global_ref *>(head.object())->sym(), val) && val.getValue<proc_type>(func))
+            return func;
+        return nullptr;
+    }
+
+    static size_t length(lisp_cell list)
+    {
+        size_t n = 0;
+        for (; list.isLispCells(); list = list.cdr())
+            n++;
+        return list == nullptr ? n : size_t(-1);
+    }
+
+    void compile_sequence(lisp_cell forms, bool tail)
+    {
+        if (!forms.isLispCells())
+        {
+            emit(OP_CONST);
+            emit(constant(nil_sexpr));
+            return;
+        }
+        for (; forms.cdr().isLispCells(); forms = forms.cdr())
+        {
+            compile(forms.car(), false);
+            emit(OP_POP);
+        }
+        compile(forms.car(), tail);
+    }
+
+    // and/or: 'op' is OP_AND or OP_OR
+    void compile_junction(lisp_cell forms, uint32_t op, bool tail)
+    {
+        if (forms == nullptr)
+        {
+            emit(OP_CONST);
+            emit(constant(false_sexpr));
+            return;
+        }
+        std::vector<uint32_t> exits;
+        for (; forms.cdr() != nullptr; forms = forms.cdr())
+        {
+            compile(forms.car(), false);
+            exits.push_back(emit_jump(op));
+        }
+        compile(forms.car(), tail);
+        for (uint32_t at: exits)
+            patch(at);
+    }
 
-    lisp_cell *val;
-    if (sexpr->isAtom())
+    void compile(lisp_cell sexpr, bool tail)
     {
-        val = eval(sexpr, env);
-        return val == false_sexpr? false_sexpr : true_sexpr;
+        symbol *s;
+        if (sexpr.isLocal())
+        {
+            emit(OP_LOCAL);
+            emit(sexpr.captured());
+            emit(sexpr.slot());
+        }
+        else if (sexpr.isSymbol())
+        {
+            emit(OP_GLOBAL);
+            emit(constant(sexpr));
+        }
+        else if (sexpr.isObject(lisp_object::CODE))
+        {
+            emit(OP_CLOSURE);
+            emit(constant(sexpr));
+        }
+        else if (sexpr.isAtom())
+        {
+            emit(OP_CONST);
+            emit(constant(sexpr));
+        }
+        else if (sexpr.car() == nullptr || sexpr.car().isImmediate() || sexpr.car().isConstant())
+        {
+            emit(OP_CONST);
+            emit(constant(bad_sexpr));
+        }
+        else if (sexpr.car().isSymbol(s) && s == sym_quote)
+        {
+            emit(OP_CONST);
+            emit(constant(sexpr.cdr().car()));
+        }
+        else if (sexpr.car().isSymbol(s) && s == sym_lambda)
+        {
+            emit(OP_EVAL);
+            emit(constant(sexpr));
+        }
+        else
+            compile_form(sexpr, tail);
     }
-    
-    lisp_cell *car = eval_or(sexpr->car(), env);
-    if (car == false_sexpr)
-        return eval_or(sexpr->cdr(), env);
-    return true_sexpr;
-}
 
-lisp_cell *eval_list(lisp_cell *sexpr, environment *env)
-{
-    if (sexpr == nullptr)
-        return nil_sexpr;
-    
-    if (sexpr->isAtom())
-        return eval(sexpr, env);
-    
-    lisp_cell *car = eval(sexpr->car(), env);
-    lisp_cell *cdr = sexpr->cdr();
-    
-    if (cdr == nullptr)
-        ;
-    else if (cdr->isAtom())
-        cdr = eval(cdr, env);
-    else
-        cdr = eval_list(cdr, env);
-    
-    return new lisp_cell(car, cdr);
-}
+    void compile_form(lisp_cell sexpr, bool tail)
+    {
+        lisp_cell args = sexpr.cdr();
+        size_t nargs = length(args);
+        proc_type func = builtin(sexpr.car());
 
-// Eval Primitives
-lisp_cell *eval_if(lisp_cell *sexpr, environment *env)
-{
-    if (!hasTwoOperands(sexpr))
-        return bad_sexpr;
-    
-    lisp_cell *car = sexpr->car();
-    lisp_cell *cdr = sexpr->cdr();
-    
-    lisp_cell *val = eval(car, env);
-    if (val != false_sexpr)
-        return eval(cdr->car(), env);
-    return eval(cdr->cdr(), env);
-}
+        if (func == &eval_if && hasTwoOperands(args))
+        {
+            compile(args.car(), false);
+            uint32_t to_else = emit_jump(OP_JUMP_FALSE);
+            compile(args.cdr().car(), tail);
+            uint32_t to_end = emit_jump(OP_JUMP);
+            patch(to_else);
+            compile(args.cdr().cdr().car(), tail);
+            patch(to_end);
+        }
+        else if (func == &eval_begin)
+            compile_sequence(args, tail);
+        else if (func == &eval_and)
+            compile_junction(args, OP_AND, tail);
+        else if (func == &eval_or)
+            compile_junction(args, OP_OR, tail);
+        else if ((func == &eval_define || func == &eval_setq) && hasTwoOperands(args) &&
+                 (args.car().isLocal() || args.car().isSymbol()))
+        {
+            compile(args.cdr().car(), false);
+            lisp_cell target = args.car();
+            if (target.isLocal())
+            {
+                emit(OP_SET_LOCAL);
+                emit(target.captured());
+                emit(target.slot());
+            }
+            else
+            {
+                emit(OP_SET_GLOBAL);
+                emit(constant(target));
+            }
+            emit(func == &eval_define);
+        }
+        else if ((func == &eval_car || func == &eval_cdr) && nargs == 1)
+        {
+            compile(args.car(), false);
+            emit(func == &eval_car ? OP_CAR : OP_CDR);
+        }
+        else if ((func == &proc_add || func == &proc_sub || func == &proc_cmplt) && nargs == 2)
+        {
+            compile(args.car(), false);
+            compile(args.cdr().car(), false);
+            emit(func == &proc_add ? OP_ADD : func == &proc_sub ? OP_SUB : OP_LT);
+        }
+        else if (nargs == size_t(-1))
+        {
+            emit(OP_EVAL);
+            emit(constant(sexpr));
+        }
+        else
+            compile_call(sexpr, nargs, tail);
+    }
 
-// Handle both
-//  define: current_scope_only
-//  set!:   search up and scope and do not create variable if not found
-lisp_cell *eval_set(lisp_cell *sexpr, environment *env, bool is_define)
-{
-    if (!hasTwoOperands(sexpr))
-        return bad_sexpr;
-    
-    std::string s;
-    if (sexpr->car()->getValue<std::string>(s) == false)
-        return bad_sexpr;
-      
-    lisp_cell *val = eval(sexpr->cdr(), env);
-    if (env->UpdateSymbol(s, val, is_define))
-        return val;
-    
-    // only when is_define == false, setq
-    std::cout << "Variable '" << s << "' does not exist." << std::endl;
-    return nil_sexpr;
-}
+    void compile_call(lisp_cell sexpr, size_t nargs, bool tail)
+    {
+        uint32_t exits[2];
+        size_t nexits = 0;
+        if (sexpr.car().isObject(lisp_object::GLOBAL))
+        {
+            emit(OP_FUNCTION);
+            emit(constant(sexpr.car()));
+            exits[nexits++] = emit_target();
+        }
+        else
+            compile(sexpr.car(), false);
 
-lisp_cell *eval_setq(lisp_cell *sexpr, environment *env)
-{
-    return eval_set(sexpr, env, false);
-}
+        emit(OP_PROC_CALL);
+        emit(constant(sexpr.cdr()));
+        exits[nexits++] = emit_target();
+        emit(static_cast<uint32_t>(nargs));
 
-lisp_cell *eval_define(lisp_cell *sexpr, environment *env)
-{
-    return eval_set(sexpr, env, true);
-}
+        for (lisp_cell args = sexpr.cdr(); args != nullptr; args = args.cdr())
+            compile(args.car(), false);
+        emit(tail ? OP_TAIL_CALL : OP_CALL);
+        emit(static_cast<uint32_t>(nargs));
 
-lisp_cell *eval_begin(lisp_cell *sexpr, environment *env)
-{
-    if (sexpr == nullptr)
-        return nil_sexpr;
-    if (sexpr->isAtom())
-        return eval(sexpr, env);
-    lisp_cell *val = eval(sexpr->car(), env);
-    if (sexpr->cdr())
-        val = eval(sexpr->cdr(), env);
-    return val;
-}
+        while (nexits > 0)
+            patch(exits[--nexits]);
+    }
 
-// Primitive functions
-void add_globals(environment &env)
-{
-    env["#nil"]     = nil_sexpr;
-    env["#f"]       = false_sexpr;
-    env["#t"]       = true_sexpr;
-    env["+"]        = new lisp_cell(&proc_add);
-    env["-"]        = new lisp_cell(&proc_sub);
-    env["*"]        = new lisp_cell(&proc_mul);
-    env["/"]        = new lisp_cell(&proc_div);
-    env[">"]        = new lisp_cell(&proc_cmpgt);
-    env["<"]        = new lisp_cell(&proc_cmplt);
-    env["<="]       = new lisp_cell(&proc_cmple);
-    env[">="]       = new lisp_cell(&proc_cmpge);
-    env["eq"]       = new lisp_cell(&proc_cmpeq);
-    env["ne"]       = new lisp_cell(&proc_cmpne);
-    
-    env["and"]      = new lisp_cell(&eval_and);
-    env["append"]   = new lisp_cell(&eval_append);
-    env["begin"]    = new lisp_cell(&eval_begin);
-    env["car"]      = new lisp_cell(&eval_car);
-    env["cdr"]      = new lisp_cell(&eval_cdr);
-    env["cons"]     = new lisp_cell(&eval_cons);
-    env["define"]   = new lisp_cell(&eval_define);
-    env["if"]       = new lisp_cell(&eval_if);
-    env["length"]   = new lisp_cell(&eval_length);
-    env["list"]     = new lisp_cell(&eval_list);
-    env["not"]      = new lisp_cell(&eval_not);
-    env["nullp"]    = new lisp_cell(&eval_nullp);
-    env["or"]       = new lisp_cell(&eval_or);
-    env["setq"]     = new lisp_cell(&eval_setq);
-}
-
-lisp_cell *eval_proc(lisp_cell *proc, lisp_cell *func_body, environment *env)
-{
-    proc_type native_func;
-    
-    if (proc->getValue<proc_type>(native_func))
-        return native_func(func_body, env);
-    
-    return nil_sexpr;
-}
+    bytecode &bc_;
+    environment *env_;
+};
 
-lisp_cell *eval_lambda(lambda *l, lisp_cell *args, environment *env)
+// the current bytecode of the lambda 'l', compiled if needed
+bytecode *vm_compile(lambda *l)
 {
-    // std::cout << "params: " << printLispObject(l->params()) << " args: " << printLispObject(args) << std::endl;
-    bool error;
-    environment *new_env = new environment(l->params(), args, l->env(), error);
-    // std::cout << "body: " << printLispObject(l->body()) << std::endl;
-    
-    lisp_cell *val = nil_sexpr;
-    if (!error)
-        val = eval(l->body(), new_env);
-    delete(new_env);
-    
-    return val;
-    
+    lambda_code *code = l->code();
+    bytecode *bc = code->compiled();
+    if (bc == nullptr || bc->epoch != proc_redefinitions)
+    {
+        bc = new bytecode;
+        bc->epoch = proc_redefinitions;
+        compiler(*bc, l->env()).compile_body(code->body());
+        code->set_compiled(bc);
+    }
+    return bc;
 }
 
-lisp_cell *eval_lambda(lisp_cell *sexpr, lisp_cell *args, environment *env)
-{
-    lambda *l;
-    
-    if (sexpr != nullptr && sexpr->getValue<lambda *>(l))
-        return eval_lambda(l, args, env);
-    return nil_sexpr;
-}
+/* The dispatch loop of vm_execute is direct threaded when LISP_COMPUTED_GOTO is defined and the compiler supports
+ * labels as values (GCC, Clang): every instruction jumps straight to the code of the next one through a table of label
+ * addresses, instead of going back to a single switch. Otherwise it is a portable switch in a loop.
+ */
+#if defined(LISP_COMPUTED_GOTO) && defined(__GNUC__)
+#define VM_THREADED         1
+#define VM_DISPATCH()       goto *dispatch[*pc++];
+#define VM_CASE(op)         L_##op:
+#define VM_NEXT()           VM_DISPATCH()
+#else
+#define VM_THREADED         0
+#define VM_DISPATCH()       switch (*pc++)
+#define VM_CASE(op)         case op:
+#define VM_NEXT()           continue
+#endif
 
-lisp_cell *makeLambda(lisp_cell *sexpr, environment *env)
+// OP_ADD, OP_SUB or OP_LT on operands that are not both fixnums
+lisp_cell vm_arith(uint32_t op, lisp_cell a, lisp_cell b)
 {
-    // ensure we have an parameter list, even if empty, and a body
-    // (lambda (args) body)
-    if (sexpr->cdr() == nullptr ||
-        !sexpr->cdr()->isLispCells() ||
-        (sexpr->cdr()->car() != nullptr &&          // params
-         !sexpr->cdr()->car()->isLispCells()) ||
-        sexpr->cdr()->cdr() == nullptr)             // body
-        return nullptr;
-                               // params            // body
-    lambda *a_lambda = new lambda{sexpr->cdr()->car(), sexpr->cdr()->cdr(), env};
-    
-    lisp_cell *val = new lisp_cell(a_lambda);
-    return val;
+    number n1, n2;
+    if (!n1.set(a) || !n2.set(b))
+        return false_sexpr;
+    if (op == OP_LT)
+        return compare(n1, n2, [](auto x, auto y) { return x < y; }) ? true_sexpr : false_sexpr;
+    if (op == OP_ADD)
+        arith(n1, n2, add_op());
+    else
+        arith(n1, n2, sub_op());
+    return n1.cell();
 }
 
-// EVAL, evaluate an S-expression
-lisp_cell *eval(lisp_cell *sexpr, environment *env)
-{
-    if (sexpr == nullptr || sexpr == nil_sexpr || sexpr == bad_sexpr || sexpr->isConstant())
-        return sexpr;
+// the bytecode a vm_execute call is running, which a recompile of its lambda_code must not free
+class running_bytecode {
+public:
+    running_bytecode(): code_(nullptr), bc_(nullptr) {}
+    ~running_bytecode()                             { release(); }
 
-    lisp_cell *val;
-    std::string s;
-    
-    // Symbol
-    if (sexpr->isAtom())
+    running_bytecode(const running_bytecode &) = delete;
+    running_bytecode &operator=(const running_bytecode &) = delete;
+
+    void acquire(lambda_code *code, bytecode *bc)
     {
-        if (sexpr->isSymbol(s) && env->FindSymbol(s, val))
-            return val;
-        return nil_sexpr;
+        code_ = code;
+        bc_ = bc;
+        bc->running++;
     }
-    
-    lisp_cell *car = sexpr->car();
-    if (car == nullptr || car == nil_sexpr || car == bad_sexpr || car->isConstant())
-        return bad_sexpr;
-    
-    if (car->isSymbol(s))
-    {
-        if (s == "quote")
-            return sexpr->cdr();
-        if (s == "lambda")
-            return makeLambda(sexpr, env);
-        
-        if (env->FindSymbol(s, val) == false)
-            return bad_sexpr;
-
-        lambda *l;
-        if (val->isLambda(l))
-            return eval_lambda(l, sexpr->cdr(), env);
-        return eval_proc(val, sexpr->cdr(), env);
+    void release(void)
+    {
+        if (bc_ != nullptr)
+            code_->release(bc_);
+        bc_ = nullptr;
     }
-    
-    else if (car->car() != nullptr && car->car()->isSymbol(s) && s == "lambda" && car->cdr() != nullptr && car->cdr()->isLispCells())
+
+private:
+    lambda_code *code_;
+    bytecode *bc_;
+};
+
+// run the lambda 'l' with the VM. Its 'nargs' arguments are on top of the argument stack, and are popped.
+lisp_cell vm_execute(lambda *l, uint32_t nargs)
+{
+#if VM_THREADED
+    // in opcode_t order
+    static void *const dispatch[] = {
+        &&L_OP_CONST, &&L_OP_LOCAL, &&L_OP_GLOBAL, &&L_OP_FUNCTION, &&L_OP_SET_LOCAL, &&L_OP_SET_GLOBAL, &&L_OP_POP,
+        &&L_OP_JUMP, &&L_OP_JUMP_FALSE, &&L_OP_AND, &&L_OP_OR, &&L_OP_CLOSURE, &&L_OP_PROC_CALL, &&L_OP_CALL,
+        &&L_OP_TAIL_CALL, &&L_OP_RETURN, &&L_OP_CAR, &&L_OP_CDR, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_LT, &&L_OP_EVAL
+    };
+    static_assert(sizeof dispatch / sizeof dispatch[0] == OP_EVAL + 1, "dispatch table out of sync with opcode_t");
+#endif
+    std::vector<lisp_cell> &stack = gc.argument_stack();
+    gc_root root(l);
+    tail_frame frame;
+    running_bytecode running;
+
+    environment *env;
+    const uint32_t *code;
+    const lisp_cell *constants;
+    const uint32_t *pc;
+    size_t base;
+    lisp_cell val;
+    lisp_int_t n1, n2;
+    lambda *callee;
+    lambda_code *callee_code;
+    proc_type func;
+
+    // one round per call, the first one and then the calls in tail position
+    for (;;)
     {
-        lisp_cell *anonymous_func = makeLambda(car, env);
-        return eval_lambda(anonymous_func, sexpr->cdr(), env);
+        // done with the bytecode of the previous round, before its lambda can be collected
+        running.release();
+        if (!check_arguments(l->code(), nargs))
+        {
+            gc.pop_arguments(nargs);
+            return nil_sexpr;
+        }
+        env = frame.enter(l);
+        bytecode *bc = vm_compile(l);
+        running.acquire(l->code(), bc);
+        code = bc->code.data();
+        constants = bc->constants.data();
+        base = stack.size();
+        pc = code;
+
+        for (;;)
+        {
+            VM_DISPATCH()
+            {
+            VM_CASE(OP_CONST)
+                stack.push_back(constants[pc[0]]);
+                pc += 1;
+                VM_NEXT();
+            VM_CASE(OP_LOCAL)
+                if (!env->FindLocal(lisp_cell::local(pc[0] != 0, pc[1]), val))
+                    val = nil_sexpr;
+                stack.push_back(val);
+                pc += 2;
+                VM_NEXT();
+            VM_CASE(OP_GLOBAL)
+                if (!env->FindSymbol(constants[pc[0]].sym(), val))
+                    val = nil_sexpr;
+                stack.push_back(val);
+                pc += 1;
+                VM_NEXT();
+            VM_CASE(OP_FUNCTION)
+                if (env->FindGlobal(static_cast<global_ref *>(constants[pc[0]].object()), val))
+                {
+                    stack.push_back(val);
+                    pc += 2;
+                }
+                else
+                {
+                    stack.push_back(bad_sexpr);
+                    pc = code + pc[1];
+                }
+                VM_NEXT();
+            VM_CASE(OP_SET_LOCAL)
+                val = set_variable(lisp_cell::local(pc[0] != 0, pc[1]), stack.back(), env, pc[2] != 0);
+                stack.back() = val;
+                pc += 3;
+                VM_NEXT();
+            VM_CASE(OP_SET_GLOBAL)
+                val = set_variable(constants[pc[0]], stack.back(), env, pc[1] != 0);
+                stack.back() = val;
+                pc += 2;
+                VM_NEXT();
+            VM_CASE(OP_POP)
+                stack.pop_back();
+                VM_NEXT();
+            VM_CASE(OP_JUMP)
+                pc = code + pc[0];
+                VM_NEXT();
+            VM_CASE(OP_JUMP_FALSE)
+                val = stack.back();
+                stack.pop_back();
+                pc = val == false_sexpr ? code + pc[0] : pc + 1;
+                VM_NEXT();
+            VM_CASE(OP_AND)
+            VM_CASE(OP_OR)
+                if ((stack.back() == false_sexpr) == (pc[-1] == OP_AND))
+                    pc = code + pc[0];
+                else
+                {
+                    stack.pop_back();
+                    pc += 1;
+                }
+                VM_NEXT();
+            VM_CASE(OP_CLOSURE)
+                callee_code = static_cast<lambda_code *>(constants[pc[0]].object());
+                val = lisp_cell(new (callee_code->ncaptured()) lambda(callee_code, env));
+                stack.push_back(val);
+                pc += 1;
+                VM_NEXT();
+            VM_CASE(OP_PROC_CALL)
+                // a built-in function gets the argument list unevaluated, anything else but a lambda is nil
+                if (stack.back().isLambda(callee))
+                {
+                    callee_code = callee->code();
+                    if (callee_code->nparams() == pc[2] && !callee_code->unnamed_params())
+                    {
+                        pc += 3;
+                        VM_NEXT();
+                    }
+                    // the callee stays rooted on the stack
+                    if (eval_arguments(callee_code, constants[pc[0]], env))
+                        val = vm_execute(callee, callee_code->nparams());
+                    else
+                        val = nil_sexpr;
+                }
+                else
+                    val = stack.back().getValue<proc_type>(func) ? func(constants[pc[0]], env) : nil_sexpr;
+                stack.back() = val;
+                pc = code + pc[1];
+                VM_NEXT();
+            VM_CASE(OP_CALL)
+                val = stack[stack.size() - pc[0] - 1];
+                if (val.isLambda(callee))
+                    val = vm_execute(callee, pc[0]);
+                else
+                {
+                    gc.pop_arguments(pc[0]);
+                    val = nil_sexpr;
+                }
+                stack.back() = val;
+                pc += 1;
+                VM_NEXT();
+            VM_CASE(OP_TAIL_CALL)
+                if (!stack[stack.size() - pc[0] - 1].isLambda(callee))
+                {
+                    gc.pop_arguments(pc[0]);
+                    stack.back() = nil_sexpr;
+                    pc += 1;
+                    VM_NEXT();
+                }
+                // move the arguments down over this call's stack, and run the callee in the next round
+                l = callee;
+                nargs = pc[0];
+                std::copy(stack.end() - nargs, stack.end(), stack.begin() + base);
+                stack.resize(base + nargs);
+                goto tail_call;
+            VM_CASE(OP_RETURN)
+                val = stack.back();
+                stack.resize(base);
+                return val;
+            VM_CASE(OP_CAR)
+            VM_CASE(OP_CDR)
+                val = stack.back();
+                if (val == nullptr || val.isAtom())
+                    stack.back() = bad_sexpr;
+                else
+                    stack.back() = pc[-1] == OP_CAR ? val.car() : val.cdr();
+                VM_NEXT();
+            VM_CASE(OP_ADD)
+            VM_CASE(OP_SUB)
+            VM_CASE(OP_LT)
+                val = stack.back();
+                stack.pop_back();
+                if (val.isFixnum() && stack.back().isFixnum())
+                {
+                    // the common case, two immediates need no boxed integer tests
+                    n1 = stack.back().fixnum();
+                    n2 = val.fixnum();
+                    if (pc[-1] == OP_LT)
+                        stack.back() = n1 < n2 ? true_sexpr : false_sexpr;
+                    else
+                        stack.back() = lisp_cell(pc[-1] == OP_ADD ? n1 + n2 : n1 - n2);
+                }
+                else
+                    stack.back() = vm_arith(pc[-1], stack.back(), val);
+                VM_NEXT();
+            VM_CASE(OP_EVAL)
+                val = eval(constants[pc[0]], env);
+                stack.push_back(val);
+                pc += 1;
+                VM_NEXT();
+            }
+        }
+    tail_call:
+        ;
     }
-    
-    return nil_sexpr;
 }
 
+#undef VM_THREADED
+#undef VM_DISPATCH
+#undef VM_CASE
+#undef VM_NEXT
+
 // REPL and support functions
 
-typedef std::vector<std::string> Tokens;
+const char *ops = {"()[]{}:*/"};
 
-#define EOINPUT(c)  ((c) == 0 || (c) == '\n')
+// true if 's' starts with a number: an optional sign, and a digit or a '.' followed by a digit
+inline bool isNumber(std::string_view s)
+{
+    size_t i = !s.empty() && (s[0] == '+' || s[0] == '-');
+    return i < s.size() && (isdigit(s[i]) || (s[i] == '.' && i + 1 < s.size() && isdigit(s[i + 1])));
+}
 
-const char *ops = {"()[]{}:*/"};
+/* reader: reads the lisp objects of a text one after the other, in a single pass that builds the cells straight from
+ * the characters. The elements of the lists still open are kept on the argument stack, where they are roots, and the
+ * open lists themselves on an explicit stack instead of the C++ stack, so neither the nesting depth nor the length of
+ * a list is limited by anything but memory. The text must outlive the reader.
+ *
+ * A Lisp Object pseudo BNF:
+ * lisp_object = symbol | constant | '(' lisp_object* ')' | '#(' lisp_object* ')'
+ */
+class reader {
+public:
+    // OPEN_PAREN: the text ends inside a list, CLOSE_PAREN: a ')' closes no list
+    enum status { OBJECT, END, OPEN_PAREN, CLOSE_PAREN };
+
+    reader(const char *begin, const char *end): next_(begin), end_(end) {}
+    explicit reader(std::string_view text): reader(text.data(), text.data() + text.size()) {}
 
-void tokenize(Tokens &tokens, std::string &s)
+    // read the next object into 'sexpr'
+    status read(lisp_cell &sexpr);
+    // skip white space, true if nothing is left
+    bool at_end(void);
+    // the text not read yet
+    std::string_view rest(void) const               { return std::string_view(next_, end_ - next_); }
+
+private:
+    struct open_list {
+        size_t base;                                // its first element on the argument stack
+        bool vector;                                // #( ... )
+    };
+
+    std::string_view token(void);
+    lisp_cell atom(std::string_view token);
+    lisp_cell close(const open_list &list);
+
+    const char *next_;
+    const char *end_;
+    std::vector<open_list> open_;
+};
+
+bool reader::at_end(void)
+{
+    // white space and control characters separate tokens
+    while (next_ != end_ && (isspace(static_cast<unsigned char>(*next_)) || !isprint(static_cast<unsigned char>(*next_))))
+        next_++;
+    return next_ == end_;
+}
+
+// the next token, empty at the end of the text. A token is a span of the text.
+std::string_view reader::token(void)
 {
-    const char *next = s.c_str();
-    
-    while (isspace(*next) || !isprint(*next))
-        next++;
-    while (!EOINPUT(*next))
+    while (!at_end())
     {
-        std::string str;
-        
-        str = "";
+        const char *start = next_;
+        size_t left = end_ - next_;
+        // the character at 'i', 0 past the end of the text
+        auto at = [start, left](size_t i) -> int { return i < left ? static_cast<unsigned char>(start[i]) : 0; };
 
-        if (strchr(ops, *next) != nullptr)
-            str = *next++;
-        // symbol
-        else if (isalpha(*next) || *next == '_')
-            while (isalnum(*next) || *next == '_')
-                str += *next++;
+        size_t n = 0;
+        if (strchr(ops, at(0)) != nullptr)
+            n = 1;
+        // symbol, which may go on with - ! ? >, as in vector-set! or list->vector
+        else if (isalpha(at(0)) || at(0) == '_')
+            while (isalnum(at(n)) || (at(n) != 0 && strchr("_-!?>", at(n)) != nullptr))
+                n++;
+        // #( vector
+        else if (at(0) == '#' && at(1) == '(')
+            n = 2;
         // #symbol
-        else if (*next == '#' && isalpha(next[1]))
+        else if (at(0) == '#' && isalpha(at(1)))
         {
-            str += *next++;
-            while (isalnum(*next) || *next == '_')
-                str += *next++;
+            n = 1;
+            while (isalnum(at(n)) || at(n) == '_')
+                n++;
         }
-        // integer
-        else if (isdigit(*next) || ((*next == '+' || *next == '-') && isdigit(next[1])))
+        // number, an integer or a double
+        else if (isNumber(std::string_view(start, left)))
         {
-            if (*next == '+' || *next == '-')
-                str += *next++;
+            if (at(0) == '+' || at(0) == '-')
+                n++;
             int base = 10;
-            if (*next == '0' && islower(next[1]) == 'x' && isxdigit(next[2]))
+            if (at(n) == '0' && tolower(at(n + 1)) == 'x' && isxdigit(at(n + 2)))
             {
-                str += "0x";
-                next += 2;
+                n += 2;
                 base = 16;
             }
-            while (isdigit(*next) || (base == 16 && isxdigit(*next)))
-                str += *next++;
+            while (isdigit(at(n)) || (base == 16 && isxdigit(at(n))))
+                n++;
+            // fraction and exponent of a double
+            if (base == 10 && at(n) == '.')
+                do
+                    n++;
+                while (isdigit(at(n)));
+            if (base == 10 && (at(n) == 'e' || at(n) == 'E') &&
+                (isdigit(at(n + 1)) || ((at(n + 1) == '+' || at(n + 1) == '-') && isdigit(at(n + 2)))))
+            {
+                n += 2;
+                while (isdigit(at(n)))
+                    n++;
+            }
         }
         // + or -
-        else if (*next == '+' || *next == '-')
-            str += *next++;
+        else if (at(0) == '+' || at(0) == '-')
+            n = 1;
         // < > >= <=
-        else if (*next == '<' || *next == '>')
-        {
-            str += *next++;
-            if (*next == '=')
-                str += *next++;
-        }
+        else if (at(0) == '<' || at(0) == '>')
+            n = at(1) == '=' ? 2 : 1;
         // "quoted string"
-        else if (*next == '"')
+        else if (at(0) == '"')
         {
-            str += *next++;
-            while (!EOINPUT(*next) && *next != '"')
+            n = 1;
+            while (at(n) != 0 && at(n) != '"')
             {
-                str += *next;
-                if (*next == '\'' && !EOINPUT(next[1]))
-                    str += *++next;
-                next++;
+                if (at(n) == '\'' && at(n + 1) != 0)
+                    n++;
+                n++;
             }
-            if (*next == '"')
-                str += *next++;
+            if (at(n) == '"')
+                n++;
         }
-        if (str == "")
-            std::cerr << "unknown character '" << *next++ << "' ignored." << std::endl;
-        
-        // anything else
-        else
-            tokens.push_back(str);
-        while (!EOINPUT(*next) && (isspace(*next) || !isprint(*next)))
-            next++;
+
+        if (n == 0)
+        {
+            std::cerr << "unknown character '" << *next_++ << "' ignored." << std::endl;
+            continue;
+        }
+        next_ += n;
+        return std::string_view(start, n);
     }
+    return std::string_view();
 }
 
-lisp_cell *makeLispObject(Tokens::iterator &token_stream, Tokens::iterator &end);
-lisp_cell *makeLispTree(Tokens::iterator &token_stream, Tokens::iterator &end);
-
-// A Lisp Object pseudo BNF:
-// lisp_object = symbol | constant | '(' lisp_tree | ')' : nil
-// lisp_tree   = lisp_object lisp_tree : cons(_1, _2)
-//
-lisp_cell *makeLispObject(Tokens::iterator &token_stream, Tokens::iterator &end)
+// a number token, see reader::token
+lisp_cell makeNumber(std::string_view token)
 {
-    if (token_stream == end)
-        return nullptr;
-    std::string token = *token_stream;
-    
-    if (isdigit(token[0]))
+    const char *first = token.data(), *last = first + token.size();
+    if (*first == '+')
+        first++;
+
+    if (token.find_first_of(".eE") != std::string_view::npos && token.find_first_of("xX") == std::string_view::npos)
+    {
+        double d = 0;
+        // from_chars leaves 'd' alone when the literal is out of range, strtod gives +-HUGE_VAL on overflow and a
+        // signed 0 or a denormal on underflow
+        if (std::from_chars(first, last, d).ec == std::errc::result_out_of_range)
+            d = strtod(std::string(first, last).c_str(), nullptr);
+        return lisp_cell(d);
+    }
+
+    bool negative = *first == '-';
+    const char *digits = negative ? first + 1 : first;
+    int base = 10;
+    if (last - digits > 2 && digits[0] == '0' && tolower(digits[1]) == 'x')
     {
-        int64_t n = strtoll(&token[0], 0, 0);
-        return new lisp_cell(n);
+        digits += 2;
+        base = 16;
     }
+    uint64_t m;
+    auto result = std::from_chars(digits, last, m, base);
+    if (result.ec == std::errc() && m <= (negative ? uint64_t(1) << 63 : (uint64_t(1) << 63) - 1))
+        return lisp_cell(static_cast<lisp_int_t>(negative ? 0 - m : m));
+    return lisp_cell(bigint::parse(std::string_view(digits, last - digits), base, negative));
+}
+
+// a token other than a parenthesis
+lisp_cell reader::atom(std::string_view token)
+{
+    if (isNumber(token))
+        return makeNumber(token);
     if (token[0] == '"')
     {
-        const char *s = strdup((char *)token.c_str());
-        return new lisp_cell(s);
+        // strip the quotes, the printer puts them back
+        return lisp_cell(token.substr(1, token.size() - (token.size() > 1 && token.back() == '"' ? 2 : 1)));
     }
-    if (token[0] != '(')
+
+    // symbols are case insensitive, only a name with upper case letters is copied to lower it
+    std::string lower;
+    if (std::any_of(token.begin(), token.end(), [](char c) { return isupper(c); }))
     {
-        boost::to_lower(token);
-        return new lisp_cell(token);
+        lower.assign(token);
+        for (auto &c: lower)
+            c = static_cast<char>(tolower(c));
+        token = lower;
     }
-    return makeLispTree(token_stream, end);
+    for (size_t i = 0; i < sizeof immediate_names / sizeof immediate_names[0]; i++)
+        if (token == immediate_names[i])
+            return lisp_cell::immediate(i);
+    return lisp_cell(intern(token));
 }
 
-lisp_cell *makeLispTree(Tokens::iterator &token_stream, Tokens::iterator &end)
+// make the list or vector of the elements of 'list' and pop them off the argument stack
+lisp_cell reader::close(const open_list &list)
 {
-    std::string token = *++token_stream;
-    if (token[0] == ')')
-        return nullptr;
-    lisp_cell *car = makeLispObject(token_stream, end);
-    lisp_cell *cdr = makeLispTree(token_stream, end);
-    
-    // optimize cdr
-    if (cdr != nullptr && cdr->isLispCells() && cdr->car() != nullptr && cdr->cdr() == nullptr)
-        cdr = cdr->car();
-
-    return new lisp_cell(car, cdr);
+    size_t n = gc.argument_stack().size() - list.base;
+    const lisp_cell *elements = gc.top_arguments(n);
+    lisp_cell sexpr;
+    if (list.vector && n > lisp_vector::MAX_SIZE)
+        sexpr = bad_sexpr;
+    else if (list.vector)
+    {
+        lisp_vector *v = new (n) lisp_vector(n);
+        for (size_t i = 0; i < n; i++)
+            v->set(i, elements[i]);
+        sexpr = lisp_cell(v);
+    }
+    else
+    {
+        // program text is long-lived, allocate it in the old generation. allocate_old_cons roots its arguments, so
+        // the list built so far survives a collection.
+        sexpr = nullptr;
+        for (size_t i = n; i-- > 0;)
+            sexpr = lisp_cell(gc.allocate_old_cons(elements[i], sexpr));
+    }
+    gc.pop_arguments(n);
+    return sexpr;
 }
 
-// convert a Lisp tree to a string
-std::string printLispTree(lisp_cell *sexpr)
+reader::status reader::read(lisp_cell &sexpr)
 {
-    std::string s = printLispObject(sexpr->car());
-    
-    if (sexpr->cdr() == nullptr || sexpr->cdr() == nil_sexpr)
-        s += ")";
-    else if (sexpr->cdr()->isLispCells())
-        s += " " + printLispTree(sexpr->cdr());
-    else
-        s += " . " + printLispObject(sexpr->cdr()) + ")";
-    return s;
+    open_.clear();
+    for (;;)
+    {
+        std::string_view token = this->token();
+        if (token.empty())
+        {
+            if (open_.empty())
+                return END;
+            gc.pop_arguments(gc.argument_stack().size() - open_[0].base);
+            return OPEN_PAREN;
+        }
+
+        lisp_cell object;
+        if (token == "(" || token == "#(")
+        {
+            open_.push_back({gc.argument_stack().size(), token[0] == '#'});
+            continue;
+        }
+        else if (token == ")")
+        {
+            if (open_.empty())
+                return CLOSE_PAREN;
+            object = close(open_.back());
+            open_.pop_back();
+        }
+        else
+            object = atom(token);
+
+        if (open_.empty())
+        {
+            sexpr = object;
+            return OBJECT;
+        }
+        gc.push_argument(object);
+    }
 }
 
-// convert a Lisp object to a string
-std::string printLispObject(lisp_cell *sexpr)
+// append an object that is neither a list nor a vector to 'out'
+void printAtom(std::string &out, lisp_cell sexpr)
 {
     if (sexpr == nullptr)
-        return "null";
-    
-    lambda *l;
-    if (sexpr->isLambda(l))
-        return "<Lambda>";
-    
-    if (sexpr->isLispCells())
-        return "(" + printLispTree(sexpr);
+    {
+        out += "null";
+        return;
+    }
 
+    lambda *l;
     lisp_int_t n;
     double d;
     const char *s;
-    std::string str;
-    
-    char buf[30];
-    if (sexpr->getValue<lisp_int_t>(n))
+    symbol *sym;
+    char buf[32];
+
+    if (sexpr.isLambda(l))
+        out += "<Lambda>";
+    else if (sexpr.isObject(lisp_object::HASH_TABLE))
+        out += "<HashTable>";
+    else if (sexpr.isImmediate())
+        out += immediate_names[sexpr.bits() >> 3];
+    else if (sexpr.getValue<lisp_int_t>(n))
+        out.append(buf, std::to_chars(buf, buf + sizeof buf, n).ptr);
+    else if (sexpr.isObject(lisp_object::INTEGER))
+        out += static_cast<lisp_integer *>(sexpr.object())->value().to_string();
+    else if (sexpr.getValue<double>(d))
+    {
+        // the shortest digits that read back as the same double, and a ".0" to tell it from an integer
+        char *end = std::to_chars(buf, buf + sizeof buf, d).ptr;
+        out.append(buf, end);
+        if (std::all_of(buf, end, [](char c) { return isdigit(c) || c == '-'; }))
+            out += ".0";
+    }
+    else if (sexpr.getValue<const char *>(s))
+        out.append("\"").append(s).append("\"");
+    else if (sexpr.getValue<symbol *>(sym))
+        out += sym->name();
+    else
+        out += "bad-symbol";
+}
+
+/* append the printed form of a Lisp object to 'out'. Lists and vectors are walked with an explicit stack of the ones
+ * still open and cdr chains are followed in a loop, so neither the length nor the depth of a list uses C++ stack.
+ * Printing does not allocate lisp values, so no collection can run in between.
+ */
+void printLispObject(std::string &out, lisp_cell sexpr)
+{
+    struct open_list {
+        lisp_cell list;                             // the cell whose car is being printed
+        lisp_vector *vector;                        // or the vector and the index of the element
+        size_t index;
+        bool dotted;                                // the cdr of a dotted pair is being printed
+    };
+    std::vector<open_list> open;
+
+    for (;;)
     {
-        sprintf(buf, "%lld", n);
-        return buf;
+        lisp_vector *v;
+        if (sexpr.isLispCells())
+        {
+            out += '(';
+            open.push_back({sexpr, nullptr, 0, false});
+            sexpr = sexpr.car();
+            continue;
+        }
+        if (sexpr.isVector(v) && v->size() > 0)
+        {
+            out += "#(";
+            open.push_back({nullptr, v, 0, false});
+            sexpr = v->get(0);
+            continue;
+        }
+        if (sexpr.isVector(v))
+            out += "#()";
+        else
+            printAtom(out, sexpr);
+
+        // go on with the next element of the innermost open list or vector, closing the finished ones
+        for (;;)
+        {
+            if (open.empty())
+                return;
+            open_list &o = open.back();
+            if (o.vector != nullptr)
+            {
+                if (++o.index < o.vector->size())
+                {
+                    out += ' ';
+                    sexpr = o.vector->get(o.index);
+                    break;
+                }
+            }
+            else if (!o.dotted)
+            {
+                lisp_cell cdr = o.list.cdr();
+                if (cdr.isLispCells())
+                {
+                    out += ' ';
+                    o.list = cdr;
+                    sexpr = cdr.car();
+                    break;
+                }
+                if (cdr != nullptr && cdr != nil_sexpr)
+                {
+                    out += " . ";
+                    o.dotted = true;
+                    sexpr = cdr;
+                    break;
+                }
+            }
+            out += ')';
+            open.pop_back();
+        }
     }
-    if (sexpr->getValue<double>(d))
+}
+
+// convert a Lisp object to a string
+std::string printLispObject(lisp_cell sexpr)
+{
+    std::string s;
+    printLispObject(s, sexpr);
+    return s;
+}
+
+// read the expression in 'text' and evaluate it
+lisp_cell eval_string(std::string text, environment *env)
+{
+    reader r(text);
+    lisp_cell sexpr;
+    if (r.read(sexpr) != reader::OBJECT)
+        return nil_sexpr;
+
+    gc_root root(sexpr);
+    lisp_cell val = eval(sexpr, env);
+    undefined_symbols.clear();
+    return val;
+}
+
+// evaluate the expressions in the text [begin, end) in turn and write their values to 'out', one per line. The
+// expressions may span lines. false if the parentheses are unbalanced.
+bool load(const char *begin, const char *end, environment *env, std::ostream &out)
+{
+    reader r(begin, end);
+    bool balanced = true;
+    std::string buffer;                             // reused for every value
+    for (;;)
     {
-        sprintf(buf, "%f", d);
-        return buf;
+        lisp_cell sexpr;
+        reader::status status = r.read(sexpr);
+        if (status == reader::END)
+            break;
+        if (status != reader::OBJECT)
+        {
+            out << "Too many " << (status == reader::OPEN_PAREN ? "'('" : "')'") << " parentheses." << std::endl;
+            balanced = false;
+            continue;
+        }
+
+        gc_root root(sexpr);
+        lisp_cell val = eval(sexpr, env);
+        buffer.clear();
+        printLispObject(buffer, val);
+        buffer += '\n';
+        out << buffer;
+        undefined_symbols.clear();
+        if (arena_mode)
+            gc.end_form();
     }
-    if (sexpr->getValue<const char *>(s))
-        return std::string(s);
-    if (sexpr->getValue<std::string>(str))
-        return str;
-    return "bad-symbol";
+    return balanced;
 }
 
 // the default read-eval-print-loop
@@ -944,49 +4629,43 @@ void repl(const std::string &prompt, environment *env)
         "(+ 1 2 3 (+ 3 4) 5)",                      // 18
         "(+ 1 2 3 (+ 3 4))",                        // 13
         "((lambda (a) (+ a 3)) 6)",                 // 9
-        "(define a (list 1 2 3 4))",                // (1 2 3 . 4)
-        "(define b (list 5 6 (cons 7 8) 9))",       // (5 6 (7 . 8) . 9)
-        "(length (append a b))"                     // 9
+        "(define a (list 1 2 3 4))",                // (1 2 3 4)
+        "(define b (list 5 6 (cons 7 8) 9))",       // (5 6 (7 . 8) 9)
+        "(length (append a b))"                     // 8
     };
     int  index = 0;
-    
+
     for (;;)
     {
         std::cout << prompt;
-        
-        // get input and convert to tokens (vector of std:string)
+
+        // get input and read the first expression
         std::string line;
         if (use_init && index < init.size())
             line = init[index++];
-        else
-            std::getline(std::cin, line);
-        Tokens tokens;      tokenize(tokens, line);
-        
-        // check to make sure the parentheses are balanced
-        int nparens = 0;
-        for (auto &token: tokens)
-            if (token[0] == '(')
-                nparens++;
-            else if (token[0] == ')')
-                nparens--;
-        if (nparens != 0)
-        {
-            std::cout << "Too many " << (nparens > 0? "'('" : "')'") << " parentheses." << std::endl;
+        else if (!std::getline(std::cin, line))
+            break;
+        reader r(line);
+        lisp_cell sexpr;
+        reader::status status = r.read(sexpr);
+        if (status == reader::END)
+            continue;
+
+        // the parentheses must be balanced
+        if (status != reader::OBJECT)
+        {
+            std::cout << "Too many " << (status == reader::OPEN_PAREN ? "'('" : "')'") << " parentheses." << std::endl;
             continue;
         }
-        
-        // Convert tokens into internal lisp trees
-        Tokens::iterator it_next = tokens.begin();
-        Tokens::iterator it_end  = tokens.end();
-        
-        lisp_cell *sexpr = makeLispObject(it_next, it_end);
+        gc_root root(sexpr);
         // std::cout << '"' << printLispObject(sexpr) << '"' << std::endl;
-        
+
         std::cout << printLispObject(eval(sexpr, env)) << std::endl;
-        if (it_next != it_end-1)
-            std::cout << "extraneous input: " << *it_next << "..." << std::endl;
+        if (!r.at_end())
+            std::cout << "extraneous input: " << r.rest() << "..." << std::endl;
         undefined_symbols.clear();
-        tokens.clear();
+        if (arena_mode)
+            gc.end_form();
     }
 }
 